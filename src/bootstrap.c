@@ -10,10 +10,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <SDL/SDL.h>
 
+#include "sdld3d.h"
 #include "font.h"
+#include "stream.h"
+#include "trace.h"
 
 extern void draw_scene(SDL_Surface *screen);
 
@@ -46,24 +50,87 @@ void unlock_surface(SDL_Surface *surface) {
 		SDL_UnlockSurface(surface);
 }
 
+int bpp = 32;
+
 void resize(int w, int h) {
-	assert(screen = SDL_SetVideoMode(w, h, 32,
+	assert(screen = SDL_SetVideoMode(w, h, bpp,
 		SDL_ANYFORMAT|SDL_HWSURFACE/*|SDL_DOUBLEBUF*/|SDL_VIDEORESIZE));
 }
 
+void usage(char *name) {
+	fprintf(stderr, "usage: %s [-o file|-] [-f raw|ppm|y4m] [-n frames] "
+		"[-s WxH] [-r fps] [-w] [-t file] [-c file] [-d 16|32] [-T] [-S] [-g ms]\n"
+		"  -o  render without display, streaming frames to file or stdout\n"
+		"  -f  stream format, y4m by default\n"
+		"  -n  quit after rendering that many frames\n"
+		"  -s  frame size, 640x480 by default\n"
+		"  -r  frame rate written to y4m header, 25 by default\n"
+		"  -w  wait for writer, instead of dropping frames\n"
+		"  -t  write trace of frames in chrome trace format to file\n"
+		"  -c  capture rendering calls to file, for replay tool\n"
+		"  -d  display depth, 32 by default, 16 gives RGB565\n"
+		"  -T  render into tiled buffer, copied to display at end of frame\n"
+		"  -S  resolve opaque faces by span buffer, instead of depth\n"
+		"  -g  lower resolution down to half, when frames take longer\n", name);
+	exit(-1);
+}
+
 int main(int argc, char **argv) {
 	int T0 = 0, done = 0, frames = 0;
 	float fps = 0;
+	char *output = 0, *trace = 0, *capture = 0;
+	int format = STREAM_Y4M, total_frames = 0, wait = 0, rate = 25;
+	int w = 640, h = 480, tiled = 0, spans = 0, i;
+	float budget = 0;
+	Stream *stream = 0;
+
+	for(i = 1; i < argc; i++) {
+		char *arg = i+1 < argc ? argv[i+1] : 0;
+		if(!strcmp(argv[i], "-w")) wait = 1;
+		else if(!strcmp(argv[i], "-T")) tiled = 1;
+		else if(!strcmp(argv[i], "-S")) spans = 1;
+		else if(!arg) usage(argv[0]);
+		else if(!strcmp(argv[i], "-o")) output = argv[++i];
+		else if(!strcmp(argv[i], "-t")) trace = argv[++i];
+		else if(!strcmp(argv[i], "-c")) capture = argv[++i];
+		else if(!strcmp(argv[i], "-n")) total_frames = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-r")) rate = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-g")) budget = atof(argv[++i]);
+		else if(!strcmp(argv[i], "-d")) {
+			bpp = atoi(argv[++i]);
+			if(bpp != 16 && bpp != 32) usage(argv[0]);
+		} else if(!strcmp(argv[i], "-s")) {
+			if(sscanf(argv[++i], "%dx%d", &w, &h) != 2) usage(argv[0]);
+		} else if(!strcmp(argv[i], "-f")) {
+			i++;
+			if(!strcmp(arg, "raw")) format = STREAM_RAW;
+			else if(!strcmp(arg, "ppm")) format = STREAM_PPM;
+			else if(!strcmp(arg, "y4m")) format = STREAM_Y4M;
+			else usage(argv[0]);
+		} else usage(argv[0]);
+	}
+
+	// headless mode still needs video surface, which gives pixel format
+	// to textures, but it never gets shown
+	if(output) SDL_putenv("SDL_VIDEODRIVER=dummy");
+
+	if(trace) trace_open(trace);
 
 	assert(SDL_Init(SDL_INIT_VIDEO|SDL_INIT_AUDIO) >= 0);
 
-	resize(640, 480);
+	resize(w, h);
 
-	font = font_create(IMG_Load("pics/font.png"), 16, 16, 0xff, 0xff, 0xff, 0xff);
+	if(capture) D3D_BeginCapture(capture);
+	if(tiled) D3D_SetTiled(1);
+	if(spans) D3D_Enable(D3D_SPAN_BUFFER);
+	if(budget) D3D_SetFrameBudget(budget, 0.5);
+	if(output) stream = stream_open(output, format, screen, rate, wait);
+	else font = font_create(IMG_Load("pics/font.png"), 16, 16, 0xff, 0xff, 0xff, 0xff);
 
 	while(!done) { // main loop
 		SDL_Event event;
 
+		trace_frame_begin();
 		while(SDL_PollEvent(&event)) { // read system events
 			switch(event.type) {
 				case SDL_VIDEORESIZE:
@@ -82,11 +149,27 @@ int main(int argc, char **argv) {
 			}
 		}
 
-		lock_surface(screen);
-		draw_scene(screen);
-		print("FPS:%.0f\n", fps);
-		unlock_surface(screen);
-		SDL_Flip(screen);
+		if(stream) { // frame goes to writer, instead of display
+			draw_scene(stream_frame(stream));
+			D3D_CaptureFrame();
+			TRACE_BEGIN("present");
+			stream_submit(stream);
+			TRACE_END("present");
+		} else {
+			lock_surface(screen);
+			draw_scene(screen);
+			D3D_CaptureFrame();
+			TRACE_BEGIN("text");
+			print("FPS:%.0f\n", fps);
+			TRACE_END("text");
+			unlock_surface(screen);
+			TRACE_BEGIN("present");
+			SDL_Flip(screen);
+			TRACE_END("present");
+		}
+		trace_frame_end();
+
+		if(total_frames && !--total_frames) done = 1;
 
 		frames++;
 		int t = SDL_GetTicks();
@@ -98,6 +181,9 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if(stream) stream_close(stream);
+	D3D_EndCapture();
+	trace_close();
 	SDL_Quit();
 	return 0;
 }
@@ -0,0 +1,72 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// capture file is header of two words, followed by records of public
+// calls. Record is opcode and 4-byte arguments, in native byte order.
+// Capture starts with calls, which bring renderer into state it had
+#define CAPTURE_MAGIC		0x43443344 /* "D3DC" */
+#define CAPTURE_VERSION		2
+
+// opcodes, arguments are floats unless noted
+#define CAPTURE_FRAME			1	/* end of frame */
+#define CAPTURE_INIT			2
+#define CAPTURE_ENABLE			3	/* int flags */
+#define CAPTURE_DISABLE			4	/* int flags */
+#define CAPTURE_CLEAR_SCREEN	5	/* r, g, b */
+#define CAPTURE_CLEAR_ZBUFFER	6
+#define CAPTURE_CLEAR_LIGHTS	7
+#define CAPTURE_BEGIN_QUERY		8
+#define CAPTURE_END_QUERY		9
+#define CAPTURE_PUSH			10
+#define CAPTURE_POP				11
+#define CAPTURE_LOAD_IDENTITY	12
+#define CAPTURE_LOAD_MATRIX		13	/* 16 values */
+#define CAPTURE_SCALE			14	/* x, y, z */
+#define CAPTURE_TRANSLATE		15	/* x, y, z */
+#define CAPTURE_ROTATE			16	/* x, y, z */
+#define CAPTURE_BEGIN			17	/* int type */
+#define CAPTURE_END				18
+#define CAPTURE_FLUSH			19
+#define CAPTURE_SCREEN			20	/* int w, h, bpp, rmask, gmask, bmask, amask */
+#define CAPTURE_TEXTURE			21	/* see below */
+#define CAPTURE_SET_TEXTURE		22	/* int id, 0 for none */
+#define CAPTURE_MAPPER			23	/* int mapper */
+#define CAPTURE_AMBIENT			24	/* r, g, b */
+#define CAPTURE_FRONT_FACE		25	/* int winding */
+#define CAPTURE_PERSPECTIVE		26	/* int mode */
+#define CAPTURE_NEAR_CLIP		27	/* z */
+#define CAPTURE_COLOR			28	/* r, g, b, a */
+#define CAPTURE_NORMAL			29	/* x, y, z */
+#define CAPTURE_TEX_COORD		30	/* u, v */
+#define CAPTURE_LIGHT			31	/* r, g, b */
+#define CAPTURE_VERTEX			32	/* x, y, z */
+#define CAPTURE_ELEMENTS		33	/* see below */
+#define CAPTURE_DEPTH_BITS		34	/* int bits */
+#define CAPTURE_TILED			35	/* int tiled */
+#define CAPTURE_PRESENT			36
+#define CAPTURE_RESOLUTION		37	/* scale, filter as floats */
+#define CAPTURE_BEGIN_STATIC	38	/* int drawn, 1 if layer was drawn again */
+#define CAPTURE_END_STATIC		39
+#define CAPTURE_INVALIDATE_STATIC 40
+#define CAPTURE_REDRAW			41
+
+// CAPTURE_TEXTURE defines texture, which later records refer to by id.
+// Header is followed by palette, if any, and pitch*h bytes of pixels
+typedef struct {
+	Uint32 id;
+	Uint32 w, h, pitch;
+	Uint32 bpp, rmask, gmask, bmask, amask;
+	Uint32 colors;		// palette entries, 4 bytes each
+} CaptureTexture;
+
+// CAPTURE_ELEMENTS holds vertex arrays along with indices, as they were
+// at the time of D3D_DrawElements. Header is followed by vertices*3
+// floats of positions, then normals and uvs, if present, and indices,
+// padded to 4 bytes
+typedef struct {
+	Uint32 type, count, index_size;
+	Uint32 vertices;
+	Uint32 normals, uvs;	// 1 if present
+} CaptureElements;
+
+#endif
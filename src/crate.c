@@ -48,10 +48,10 @@ void draw_cube() {
 		D3D_TexCoord(0, 1); D3D_Vertex(-1,  1,  1);
 		D3D_TexCoord(1, 1); D3D_Vertex( 1,  1,  1);
 
-		D3D_TexCoord(1, 0); D3D_Vertex( 1, -1, -1);
-		D3D_TexCoord(0, 0); D3D_Vertex(-1, -1, -1);
-		D3D_TexCoord(0, 1); D3D_Vertex(-1, -1,  1);
 		D3D_TexCoord(1, 1); D3D_Vertex( 1, -1,  1);
+		D3D_TexCoord(0, 1); D3D_Vertex(-1, -1,  1);
+		D3D_TexCoord(0, 0); D3D_Vertex(-1, -1, -1);
+		D3D_TexCoord(1, 0); D3D_Vertex( 1, -1, -1);
 	D3D_End();
 	D3D_Pop();
 }
@@ -101,10 +101,10 @@ void draw_scene(SDL_Surface *surface) {
 
 	if(first_time) {
 		D3D_Init();
+		D3D_SetTextureCache("pics/cache");
 		srand(time(0));
-		tex_crate = IMG_Load("pics/crate.jpg");
-		tex_crate = SDL_DisplayFormatAlpha(tex_crate);
-		tex_light = IMG_Load("pics/star.png");
+		tex_crate = D3D_LoadTextureAsync("pics/crate.jpg");
+		tex_light = D3D_LoadTextureAsync("pics/star.png");
 
 		for(i = 0; i < NLIGTHS; ++i) {
 			lights[i][0] = 10*(1+0.5-frand());
@@ -124,6 +124,17 @@ void draw_scene(SDL_Surface *surface) {
 
 	D3D_LoadIdentity();
 
+	// backdrop is drawn without z-test, so crate, which is deferred with
+	// D3D_DEPTH_PREPASS or D3D_SPAN_BUFFER, has to be drawn over it still
+	D3D_Push();
+	D3D_Translate(0, 0, 2000);
+	D3D_Scale(4000, 4000, 1);
+	D3D_Disable(D3D_ZTEST|D3D_LIGHTS|D3D_BLENDING|D3D_CULLING);
+	D3D_SetAmbient(1, 1, 1);
+	D3D_SetTexture(tex_crate);
+	draw_quad();
+	D3D_Pop();
+
 	// move scene root to center of screen
 
 	// scale scene
@@ -169,5 +180,6 @@ void draw_scene(SDL_Surface *surface) {
 	}
 	D3D_Pop();
 
+	D3D_Present();
 	frame++;
 }
@@ -1,76 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
 #include <SDL.h>
 #include <SDL_image.h>
 
 #include "font.h"
 
 BMFont *font_create(SDL_Surface *s, int cell_w, int cell_h, int r, int g, int b, int a) {
-	int i, j;
+	int i, j, c;
 
 	BMFont *f = (BMFont *)malloc(sizeof(BMFont));
+	memset(f, 0, sizeof(BMFont));
 
 	f->cell_w = cell_w;
 	f->cell_h = cell_h;
-	Uint32 rmask, gmask, bmask, amask;
-
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-	rmask = 0xff000000;
-	gmask = 0x00ff0000;
-	bmask = 0x0000ff00;
-	amask = 0x000000ff;
-#else
-	rmask = 0x000000ff;
-	gmask = 0x0000ff00;
-	bmask = 0x00ff0000;
-	amask = 0xff000000;
-#endif
-
-	SDL_Surface *t = SDL_CreateRGBSurface(SDL_SRCALPHA|SDL_HWSURFACE,
-		s->w, s->h, 32, rmask, gmask, bmask, amask);
+
+	// glyphs are baked into display format with alpha in top byte, as
+	// span kernel has it, so drawing needs no conversion. RGB565 display
+	// gets BGRA glyphs, which are converted per pixel
+	SDL_PixelFormat *d = SDL_GetVideoSurface()->format;
+	SDL_Surface *t = d->BytesPerPixel == 4 ?
+		SDL_CreateRGBSurface(SDL_SWSURFACE, s->w, s->h, 32,
+			d->Rmask, d->Gmask, d->Bmask, 0xff000000) :
+		SDL_CreateRGBSurface(SDL_SWSURFACE, s->w, s->h, 32,
+			0xff0000, 0xff00, 0xff, 0xff000000);
 
 	for(i = 0; i < s->h; ++i) {
-		Uint8  *ps = s->pixels + s->pitch*i;
-		Uint32 *pt = t->pixels + t->pitch*i;
+		Uint8  *ps = (Uint8*)s->pixels + s->pitch*i;
+		Uint32 *pt = (Uint32*)((Uint8*)t->pixels + t->pitch*i);
 		for(j = 0; j < s->w; ++j) {
-			pt[j] = SDL_MapRGBA(t->format, r, g, b, ps[j]);
+			int k = ps[j]*a/255;
+			pt[j] = SDL_MapRGBA(t->format, r*k/255, g*k/255, b*k/255, k);
 		}
 	}
 
-	for(i = 0; i < 256; ++i) f->widths[i] = f->cell_w;
-
-	f->s = SDL_DisplayFormatAlpha(t);
-	SDL_FreeSurface(t);
+	// glyphs are trimmed to their columns with any coverage, empty ones
+	// (space) take half of cell
+	for(c = 0; c < 256; ++c) {
+		int left = cell_w, right = -1;
+		for(i = 0; i < cell_h; ++i) {
+			Uint8 *ps = (Uint8*)s->pixels + s->pitch*(cell_h*(c/16) + i) + cell_w*(c%16);
+			for(j = 0; j < cell_w; ++j) {
+				if(!ps[j]) continue;
+				if(j < left) left = j;
+				if(j > right) right = j;
+			}
+		}
+		if(right < 0) {
+			f->lefts[c] = 0;
+			f->widths[c] = cell_w/2;
+		} else {
+			f->lefts[c] = left;
+			f->widths[c] = right - left + 2;
+		}
+	}
 
+	f->s = t;
 	return f;
 }
 
-void font_draw(SDL_Surface *s, BMFont *f, int x, int y, char *text) {
-	int c;
-	int cur_x = x;
+// dst = src + dst*(1-src_alpha) for premultiplied src, in each channel
+static void blend_pixel(Uint32 *dst, Uint32 src) {
+	Uint32 d = *dst, k = 256 - (src >> 24), r = 0;
+	int i;
+	for(i = 0; i < 32; i += 8) {
+		Uint32 c = ((src >> i) & 0xff) + (((d >> i) & 0xff)*k >> 8);
+		r |= (c > 0xff ? 0xff : c) << i;
+	}
+	*dst = r;
+}
 
-	while((c = (Uint8)*text++)) {
+// blend_pixel for RGB565 destination
+static void blend_pixel565(Uint16 *dst, Uint32 src) {
+	Uint32 p = *dst;
+	Uint32 d = ((p >> 11)*264 >> 5) << 16 | (((p >> 5) & 63)*8320 >> 11) << 8 |
+		(p & 31)*264 >> 5;
+	blend_pixel(&d, src);
+	*dst = (d >> 8 & 0xf800) | (d >> 5 & 0x07e0) | (d >> 3 & 0x1f);
+}
+
+// blends run of 'n' pixels, as blend_pixel does
+static void blend_run(Uint32 *dst, Uint32 *src, int n) {
+	static Uint16 one[4] = {256, 256, 256, 256};
+
+	if(n & 1) blend_pixel(dst + n - 1, src[n - 1]);
+
+	// two pixels per iteration
+	asm volatile(
+		"pxor %%mm7,%%mm7\n\t"			// mm7 = 0
+		"movq %3,%%mm6\n\t"				// mm6 = 1
+		"jmp 2f\n\t"
+		"1:\n\t"
+		"movq (%%esi),%%mm0\n\t"		// mm0 = src_packed
+		"movq (%%edi),%%mm1\n\t"		// mm1 = dst_packed
+		"movq %%mm1,%%mm2\n\t"
+		"punpcklbw %%mm7,%%mm1\n\t"		// mm1 = first dst
+		"punpckhbw %%mm7,%%mm2\n\t"		// mm2 = second dst
+		"movq %%mm0,%%mm3\n\t"
+		"movq %%mm0,%%mm4\n\t"
+		"punpcklbw %%mm7,%%mm3\n\t"
+		"punpckhbw %%mm7,%%mm4\n\t"
+		"pshufw $0xff,%%mm3,%%mm3\n\t"	// mm3 = first src_alpha
+		"pshufw $0xff,%%mm4,%%mm4\n\t"	// mm4 = second src_alpha
+		"movq %%mm6,%%mm5\n\t"
+		"psubw %%mm3,%%mm5\n\t"			// mm5 = 1-src_alpha
+		"pmullw %%mm5,%%mm1\n\t"		// mm1 = dst*(1-src_alpha)
+		"movq %%mm6,%%mm5\n\t"
+		"psubw %%mm4,%%mm5\n\t"
+		"pmullw %%mm5,%%mm2\n\t"
+		"psrlw $8,%%mm1\n\t"			// back from fixed point
+		"psrlw $8,%%mm2\n\t"
+		"packuswb %%mm2,%%mm1\n\t"
+		"paddusb %%mm0,%%mm1\n\t"		// mm1 = src + dst*(1-src_alpha)
+		"movq %%mm1,(%%edi)\n\t"
+		"add $8,%%esi\n\t"
+		"add $8,%%edi\n\t"
+		"2:\n\t"
+		"cmp %%edx,%%edi\n\t"
+		"jb 1b\n\t"
+		"emms\n\t"						// reset FPU after MMX
+		: "+S" (src), "+D" (dst)
+		: "d" (dst + (n & ~1)), "m" (*one)
+		: "memory"
+	);
+}
+
+// lay out text into image of its own, glyphs don't overlap, so they
+// are just copied
+static void layout(BMFont *f, FontString *t, char *text) {
+	int c, i, x = 0, y = 0;
+	char *p;
+
+	t->w = t->h = 0;
+	for(p = text; (c = (Uint8)*p); p++) {
 		if(c == '\n') {
 			y += f->cell_h;
-			cur_x = x;
+			x = 0;
 			continue;
 		}
+		x += f->widths[c];
+		if(x > t->w) t->w = x;
+		t->h = y + f->cell_h;
+	}
 
-		SDL_Rect dst;
-		dst.x = x;
- 		dst.y = y;
-		SDL_Rect src;
-		src.x = f->cell_w*(c%16);
-		src.y = f->cell_h*(c/16);
-		src.w = f->widths[c];
-		src.h = f->cell_h;
-
-		SDL_BlitSurface(f->s, &src, s, &dst);
+	t->text = strdup(text);
+	t->pixels = (Uint32*)calloc(t->w*t->h + 1, 4);
 
+	x = y = 0;
+	for(p = text; (c = (Uint8)*p); p++) {
+		if(c == '\n') {
+			y += f->cell_h;
+			x = 0;
+			continue;
+		}
+		int w = f->widths[c] - 1;
+		if(w > f->cell_w - f->lefts[c]) w = f->cell_w - f->lefts[c];
+		for(i = 0; i < f->cell_h; i++) {
+			Uint8 *src = (Uint8*)f->s->pixels + f->s->pitch*(f->cell_h*(c/16) + i) +
+				(f->cell_w*(c%16) + f->lefts[c])*4;
+			memcpy(t->pixels + (y + i)*t->w + x, src, w*4);
+		}
 		x += f->widths[c];
 	}
 }
 
+// find laid out text, or lay it out in place of least recently used one
+static FontString *lookup(BMFont *f, char *text) {
+	FontString *t = f->cache, *lru = f->cache;
+	int i;
+
+	f->clock++;
+	for(i = 0; i < FONT_CACHE; i++, t++) {
+		if(t->text && !strcmp(t->text, text)) {
+			t->used = f->clock;
+			return t;
+		}
+		if(!t->text || t->used < lru->used) lru = t;
+	}
+
+	free(lru->text);
+	free(lru->pixels);
+	layout(f, lru, text);
+	lru->used = f->clock;
+	return lru;
+}
+
+int font_draw_width(SDL_Surface *s, BMFont *f, int x, int y, char *text) {
+	FontString *t = lookup(f, text);
+	int i, x0 = x < 0 ? -x : 0, y0 = y < 0 ? -y : 0;
+	int x1 = t->w, y1 = t->h;
+
+	if(!s) return t->w;
+
+	// clip to surface
+	if(x + x1 > s->w) x1 = s->w - x;
+	if(y + y1 > s->h) y1 = s->h - y;
+
+	if(x1 <= x0) return t->w;
+	for(i = y0; i < y1; i++) {
+		Uint8 *row = (Uint8*)s->pixels + s->pitch*(y + i);
+		Uint32 *src = t->pixels + i*t->w;
+		if(s->format->BytesPerPixel == 2) {
+			int j;
+			for(j = x0; j < x1; j++)
+				if(src[j]) blend_pixel565((Uint16*)row + x + j, src[j]);
+		} else {
+			blend_run((Uint32*)row + x + x0, src + x0, x1 - x0);
+		}
+	}
+	return t->w;
+}
+
+void font_draw(SDL_Surface *s, BMFont *f, int x, int y, char *text) {
+	font_draw_width(s, f, x, y, text);
+}
 
 void font_free(BMFont *f) {
+	int i;
+	for(i = 0; i < FONT_CACHE; i++) {
+		free(f->cache[i].text);
+		free(f->cache[i].pixels);
+	}
 	SDL_FreeSurface(f->s);
 	free(f);
 }
@@ -4,14 +4,29 @@
 #include <SDL.h>
 #include <SDL_image.h>
 
+#define FONT_CACHE	16 /* laid out strings kept per font */
+
+// string laid out into image, which is blended onto screen as a whole
+typedef struct {
+	char *text;			// 0 for free slot
+	int w, h;
+	Uint32 *pixels;		// w*h premultiplied pixels
+	int used;			// font clock at last draw
+} FontString;
+
 typedef struct {
-	SDL_Surface *s;
+	SDL_Surface *s;		// glyphs in display format, premultiplied by alpha
 	int cell_w, cell_h;
-	Uint8 widths[256];
+	Uint8 lefts[256];	// first non empty column of glyph in its cell
+	Uint8 widths[256];	// advance of glyph, including one column of space
+	FontString cache[FONT_CACHE];
+	int clock;
 } BMFont;
 
+// 's' holds 8-bit coverage of 256 glyphs in 16 rows of 16 cells
 BMFont *font_create(SDL_Surface *s, int cell_w, int cell_h, int r, int g, int b, int a);
 void font_draw(SDL_Surface *s, BMFont *f, int x, int y, char *text);
+// same as font_draw, but returns width of text. Only measures if 's' is 0
 int font_draw_width(SDL_Surface *s, BMFont *f, int x, int y, char *text);
 void font_free(BMFont *f);
 
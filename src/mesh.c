@@ -0,0 +1,559 @@
+/*
+** Copyright (C) 2006 Exa
+** This code is free software; you can redistribute it and/or
+** modify it under the terms of GNU Lesser General Public License.
+*/
+
+
+// binary meshes, which are mapped into memory and drawn without parsing
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sdld3d.h"
+#include "mesh.h"
+
+// tells if stream of 'size' bytes at 'offset' lies inside of file
+static int stream_ok(Uint32 offset, Uint32 size, int file_size) {
+	return offset % MESH_ALIGN == 0 && offset >= sizeof(MeshHeader) &&
+		offset <= file_size && size <= file_size - offset;
+}
+
+Mesh *mesh_load(char *path) {
+	struct stat st;
+	int i;
+
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return 0;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(MeshHeader)) {
+		close(fd);
+		return 0;
+	}
+	void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) return 0;
+
+	MeshHeader *h = (MeshHeader*)p;
+	int n = h->vertices, size = st.st_size;
+	int ok = h->magic == MESH_MAGIC && h->version == MESH_VERSION &&
+		h->type == D3D_TRIANGLES && n <= size/12 &&
+		(h->index_size == 2 || h->index_size == 4) &&
+		h->indices <= size/h->index_size &&
+		stream_ok(h->xyz, n*3*sizeof(float), size) &&
+		(!h->normals || stream_ok(h->normals, n*3*sizeof(float), size)) &&
+		(!h->uvs || stream_ok(h->uvs, n*2*sizeof(float), size)) &&
+		stream_ok(h->index, h->indices*h->index_size, size);
+
+	// indices are checked once here, so drawing can trust them
+	for(i = 0; ok && i < h->indices; i++) {
+		Uint8 *x = (Uint8*)p + h->index;
+		Uint32 v = h->index_size == 2 ? ((Uint16*)x)[i] : ((Uint32*)x)[i];
+		ok = v < n;
+	}
+	if(ok && (n > D3D_MAX_VERTICES || h->indices/3 > D3D_MAX_FACES)) {
+		printf("mesh '%s' is too large to draw\n", path);
+		ok = 0;
+	} else if(!ok) printf("broken mesh '%s'\n", path);
+	if(!ok) {
+		munmap(p, st.st_size);
+		return 0;
+	}
+
+	Mesh *m = (Mesh*)malloc(sizeof(Mesh));
+	m->map = p;
+	m->size = st.st_size;
+	m->h = h;
+	m->xyz = (float*)((Uint8*)p + h->xyz);
+	m->normals = h->normals ? (float*)((Uint8*)p + h->normals) : 0;
+	m->uvs = h->uvs ? (float*)((Uint8*)p + h->uvs) : 0;
+	m->index = (Uint8*)p + h->index;
+	return m;
+}
+
+void mesh_draw(Mesh *m) {
+	D3D_VertexArrays(m->h->vertices, m->xyz, m->normals, m->uvs);
+	D3D_DrawElements(m->h->type, m->h->indices, m->h->index_size, m->index);
+}
+
+void mesh_free(Mesh *m) {
+	munmap(m->map, m->size);
+	free(m);
+}
+
+
+// growing array of floats or ints
+typedef struct {
+	void *p;
+	int n, max, size;
+} Array;
+
+static void *push(Array *a, int count) {
+	if(a->n + count > a->max) {
+		a->max = (a->n + count)*2;
+		a->p = realloc(a->p, a->max*a->size);
+		if(!a->p) {
+			printf("out of memory\n");
+			exit(-1);
+		}
+	}
+	void *r = (Uint8*)a->p + a->n*a->size;
+	a->n += count;
+	return r;
+}
+
+// OBJ vertex is combination of position, uv and normal indices, which
+// becomes single mesh vertex. Same combinations are found by hash table
+typedef struct {
+	int v, vt, vn;	// 1-based, 0 if missing
+	int index;		// of mesh vertex, -1 for empty slot
+} Corner;
+
+typedef struct {
+	Array positions, uvs, normals;	// as read from OBJ
+	Array xyz, tex, norm, indices;	// mesh streams
+	Corner *table;
+	int table_size;
+	int has_uvs, has_normals;
+} Importer;
+
+static Uint32 corner_hash(Corner *c) {
+	return ((Uint32)c->v*73856093) ^ ((Uint32)c->vt*19349663) ^
+		((Uint32)c->vn*83492791);
+}
+
+static void table_insert(Importer *im, Corner *c) {
+	int i = corner_hash(c) & (im->table_size-1);
+	while(im->table[i].index >= 0) i = (i+1) & (im->table_size-1);
+	im->table[i] = *c;
+}
+
+static void table_grow(Importer *im) {
+	Corner *old = im->table;
+	int i, old_size = im->table_size;
+
+	im->table_size = old_size ? old_size*2 : 1024;
+	im->table = (Corner*)malloc(im->table_size*sizeof(Corner));
+	for(i = 0; i < im->table_size; i++) im->table[i].index = -1;
+	for(i = 0; i < old_size; i++)
+		if(old[i].index >= 0) table_insert(im, old+i);
+	free(old);
+}
+
+// index of mesh vertex for corner, adding it if it is new
+static int corner_index(Importer *im, Corner *c) {
+	int i = corner_hash(c) & (im->table_size-1);
+	for(; im->table[i].index >= 0; i = (i+1) & (im->table_size-1)) {
+		Corner *t = im->table+i;
+		if(t->v == c->v && t->vt == c->vt && t->vn == c->vn)
+			return t->index;
+	}
+
+	// OBJ is right-handed, while we are left-handed, so z is flipped.
+	// Texture rows go down, while OBJ's v goes up, so v is flipped too
+	c->index = im->xyz.n/3;
+	float *s = (float*)im->positions.p + (c->v-1)*3;
+	float *d = (float*)push(&im->xyz, 3);
+	d[0] = s[0];
+	d[1] = s[1];
+	d[2] = -s[2];
+
+	d = (float*)push(&im->tex, 2);
+	d[0] = d[1] = 0;
+	if(c->vt) {
+		s = (float*)im->uvs.p + (c->vt-1)*2;
+		d[0] = s[0];
+		d[1] = 1-s[1];
+	} else im->has_uvs = 0;
+
+	d = (float*)push(&im->norm, 3);
+	d[0] = d[1] = d[2] = 0;
+	if(c->vn) {
+		s = (float*)im->normals.p + (c->vn-1)*3;
+		d[0] = s[0];
+		d[1] = s[1];
+		d[2] = -s[2];
+	} else im->has_normals = 0;
+
+	im->table[i] = *c;
+	if(im->xyz.n/3*2 > im->table_size) table_grow(im);
+	return c->index;
+}
+
+// resolve OBJ index, which can be relative to end of list
+static int obj_index(int i, int total) {
+	if(i < 0) i += total+1;
+	return i >= 1 && i <= total ? i : -1;
+}
+
+// parse "v", "v/vt", "v//vn" or "v/vt/vn"
+static int parse_corner(Importer *im, char *s, Corner *c) {
+	int vt = 0, vn = 0;
+	int v = strtol(s, &s, 10);
+	if(*s == '/') {
+		if(s[1] != '/') vt = strtol(s+1, &s, 10);
+		else s++;
+		if(*s == '/') vn = strtol(s+1, &s, 10);
+	}
+	c->v = obj_index(v, im->positions.n/3);
+	c->vt = vt ? obj_index(vt, im->uvs.n/2) : 0;
+	c->vn = vn ? obj_index(vn, im->normals.n/3) : 0;
+	return c->v > 0 && c->vt >= 0 && c->vn >= 0;
+}
+
+static int align(int x) {
+	return (x + MESH_ALIGN-1) & ~(MESH_ALIGN-1);
+}
+
+// write stream, which is placed at 'at' unless it is missing
+static int put_stream(FILE *f, Uint32 at, void *data, int size) {
+	if(!at) return 1;
+	while(ftell(f) < at) fputc(0, f);
+	return !size || fwrite(data, size, 1, f) == 1;
+}
+
+// write mesh of 'n' vertices and 'count' indices. Streams of uvs and
+// normals can be 0. Indices get narrowed in place, if they fit 16 bits
+static int write_mesh(char *path, int n, float *xyz, float *uvs,
+	float *normals, int count, Uint32 *x) {
+	MeshHeader h;
+	int i;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = MESH_MAGIC;
+	h.version = MESH_VERSION;
+	h.type = D3D_TRIANGLES;
+	h.vertices = n;
+	h.indices = count;
+	h.index_size = n <= 0x10000 ? 2 : 4;
+
+	float *p = xyz;
+	for(i = 0; i < 3; i++) h.min[i] = h.max[i] = n ? p[i] : 0;
+	for(; i < n*3; i++) {
+		if(p[i] < h.min[i%3]) h.min[i%3] = p[i];
+		if(p[i] > h.max[i%3]) h.max[i%3] = p[i];
+	}
+
+	int offset = align(sizeof(h));
+	h.xyz = offset;
+	offset = align(offset + n*3*sizeof(float));
+	if(uvs) {
+		h.uvs = offset;
+		offset = align(offset + n*2*sizeof(float));
+	}
+	if(normals) {
+		h.normals = offset;
+		offset = align(offset + n*3*sizeof(float));
+	}
+	h.index = offset;
+
+	if(h.index_size == 2)
+		for(i = 0; i < h.indices; i++) ((Uint16*)x)[i] = x[i];
+
+	FILE *f = fopen(path, "wb");
+	if(!f) {
+		printf("cant create '%s'\n", path);
+		return 0;
+	}
+	int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+		put_stream(f, h.xyz, xyz, n*3*sizeof(float)) &&
+		put_stream(f, h.uvs, uvs, n*2*sizeof(float)) &&
+		put_stream(f, h.normals, normals, n*3*sizeof(float)) &&
+		put_stream(f, h.index, x, h.indices*h.index_size);
+
+	ok = !fclose(f) && ok;
+	if(!ok) printf("cant write '%s'\n", path);
+	return ok;
+}
+
+int mesh_import_obj(char *obj, char *mesh) {
+	Importer im;
+	char line[4096];
+	int number = 0, ok = 1;
+
+	FILE *f = fopen(obj, "r");
+	if(!f) {
+		printf("cant open '%s'\n", obj);
+		return 0;
+	}
+
+	memset(&im, 0, sizeof(im));
+	im.positions.size = im.uvs.size = im.normals.size = sizeof(float);
+	im.xyz.size = im.tex.size = im.norm.size = sizeof(float);
+	im.indices.size = sizeof(Uint32);
+	im.has_uvs = im.has_normals = 1;
+	table_grow(&im);
+
+	while(ok && fgets(line, sizeof(line), f)) {
+		float *d;
+		number++;
+		if(!strncmp(line, "v ", 2)) {
+			d = (float*)push(&im.positions, 3);
+			ok = sscanf(line+2, "%f %f %f", d, d+1, d+2) == 3;
+		} else if(!strncmp(line, "vt ", 3)) {
+			d = (float*)push(&im.uvs, 2);
+			ok = sscanf(line+3, "%f %f", d, d+1) == 2;
+		} else if(!strncmp(line, "vn ", 3)) {
+			d = (float*)push(&im.normals, 3);
+			ok = sscanf(line+3, "%f %f %f", d, d+1, d+2) == 3;
+		} else if(!strncmp(line, "f ", 2)) {
+			// polygon is split into fan of triangles. OBJ faces are
+			// counter-clockwise on screen, while ours are clockwise
+			int first = -1, prev = -1, corners = 0;
+			char *t = strtok(line+2, " \t\r\n");
+			for(; ok && t; t = strtok(0, " \t\r\n"), corners++) {
+				Corner c;
+				ok = parse_corner(&im, t, &c);
+				if(!ok) break;
+				int i = corner_index(&im, &c);
+				if(corners >= 2) {
+					Uint32 *x = (Uint32*)push(&im.indices, 3);
+					x[0] = first;
+					x[1] = i;
+					x[2] = prev;
+				}
+				if(!corners) first = i;
+				prev = i;
+			}
+		}
+		// other statements (groups, materials...) are ignored
+	}
+	fclose(f);
+
+	if(!ok) printf("%s:%d: bad statement\n", obj, number);
+	else ok = write_mesh(mesh, im.xyz.n/3, (float*)im.xyz.p,
+		im.has_uvs ? (float*)im.tex.p : 0,
+		im.has_normals ? (float*)im.norm.p : 0,
+		im.indices.n, (Uint32*)im.indices.p);
+
+	free(im.positions.p);
+	free(im.uvs.p);
+	free(im.normals.p);
+	free(im.xyz.p);
+	free(im.tex.p);
+	free(im.norm.p);
+	free(im.indices.p);
+	free(im.table);
+	return ok;
+}
+
+
+// read indices of mapped mesh as 32-bit ones
+static Uint32 *mesh_indices(Mesh *m) {
+	int i, count = m->h->indices;
+	Uint32 *x = (Uint32*)malloc(count*sizeof(Uint32) + 1);
+	for(i = 0; i < count; i++) {
+		x[i] = m->h->index_size == 2 ?
+			((Uint16*)m->index)[i] : ((Uint32*)m->index)[i];
+	}
+	return x;
+}
+
+static float acmr(int count, Uint32 *x, int vertices) {
+	int *time = (int*)malloc(vertices*sizeof(int) + 1);
+	int i, misses = 0;
+
+	// vertex is in FIFO, if it went in less than MESH_CACHE misses ago
+	for(i = 0; i < vertices; i++) time[i] = -MESH_CACHE-1;
+	for(i = 0; i < count; i++) {
+		if(misses - time[x[i]] > MESH_CACHE) {
+			time[x[i]] = misses;
+			misses++;
+		}
+	}
+	free(time);
+	return count >= 3 ? (float)misses/(count/3) : 0;
+}
+
+float mesh_acmr(Mesh *m) {
+	Uint32 *x = mesh_indices(m);
+	float r = acmr(m->h->indices, x, m->h->vertices);
+	free(x);
+	return r;
+}
+
+// Tipsify (Sander, Nehab, Barczak 2007). Triangles are emitted as fans
+// around vertices, which are likely to stay in cache. 'out' gets new
+// order of triangles, 'boundary' marks triangles starting new cluster,
+// after fan broke and next vertex came from dead-end stack or scan
+static void tipsify(int count, Uint32 *x, int vertices, int *out, Uint8 *boundary) {
+	int t, i, j, n = count/3;
+	int *live = (int*)calloc(vertices+1, sizeof(int));
+	int *first = (int*)calloc(vertices+1, sizeof(int)); // adjacency offsets
+	int *adj = (int*)malloc(count*sizeof(int) + 1);
+	int *time = (int*)calloc(vertices+1, sizeof(int));
+	int *stack = (int*)malloc(count*sizeof(int) + 1);
+	int *candidates = (int*)malloc(count*sizeof(int) + 1);
+	Uint8 *emitted = (Uint8*)calloc(n+1, 1);
+	int top = 0, emit = 0, cursor = 0, stamp = MESH_CACHE+1;
+
+	// triangles of each vertex
+	for(i = 0; i < count; i++) live[x[i]]++;
+	for(i = 0; i < vertices; i++) first[i+1] = first[i] + live[i];
+	for(i = 0; i < count; i++) adj[first[x[i]]++] = i/3;
+	for(i = vertices; i > 0; i--) first[i] = first[i-1];
+	first[0] = 0;
+
+	int fan = n ? x[0] : -1, broken = 1;
+	while(fan >= 0) {
+		int total = 0;
+		for(i = first[fan]; i < first[fan+1]; i++) {
+			t = adj[i];
+			if(emitted[t]) continue;
+			emitted[t] = 1;
+			boundary[emit] = broken;
+			broken = 0;
+			out[emit++] = t;
+			for(j = 0; j < 3; j++) {
+				int v = x[t*3+j];
+				stack[top++] = v;
+				candidates[total++] = v;
+				live[v]--;
+				if(stamp - time[v] > MESH_CACHE) time[v] = stamp++;
+			}
+		}
+
+		// next fan is vertex, which will still be in cache, when its
+		// remaining triangles are emitted, and which went in earliest
+		int best = -1, priority = -1;
+		for(i = 0; i < total; i++) {
+			int v = candidates[i], p = 0;
+			if(!live[v]) continue;
+			if(stamp - time[v] + 2*live[v] <= MESH_CACHE) p = stamp - time[v];
+			if(p > priority) {
+				priority = p;
+				best = v;
+			}
+		}
+		if(best < 0) { // dead end, fall back to recent vertices
+			broken = 1;
+			while(top && !live[stack[top-1]]) top--;
+			if(top) best = stack[--top];
+			else {
+				while(cursor < vertices && !live[cursor]) cursor++;
+				if(cursor < vertices) best = cursor;
+			}
+		}
+		fan = best;
+	}
+
+	free(live);
+	free(first);
+	free(adj);
+	free(time);
+	free(stack);
+	free(candidates);
+	free(emitted);
+}
+
+typedef struct {
+	int first, total;	// triangles in tipsified order
+	float key;			// how much cluster faces outwards
+} Cluster;
+
+static int cluster_cmp(const void *a, const void *b) {
+	float d = ((Cluster*)b)->key - ((Cluster*)a)->key;
+	return d > 0 ? 1 : d < 0 ? -1 : 0;
+}
+
+// draw clusters facing outwards from mesh center first, as they are
+// likely to hide others (Sander et al. linear-speed overdraw ordering)
+static void order_clusters(int n, Uint32 *x, float *xyz, int *order, Uint8 *boundary) {
+	Cluster *c = (Cluster*)malloc(n*sizeof(Cluster) + 1);
+	int *sorted = (int*)malloc(n*sizeof(int) + 1);
+	float center[3] = {0, 0, 0};
+	int i, j, k, total = 0;
+
+	for(i = 0; i < n*3; i++)
+		for(k = 0; k < 3; k++) center[k] += xyz[x[i]*3+k]/(n*3);
+
+	for(i = 0; i < n; i = j) {
+		float p[3] = {0, 0, 0}, nrm[3] = {0, 0, 0}, area = 0;
+		for(j = i; j < n && (j == i || !boundary[j]); j++) {
+			float *a = xyz + x[order[j]*3]*3;
+			float *b = xyz + x[order[j]*3+1]*3;
+			float *e = xyz + x[order[j]*3+2]*3;
+			float u[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]};
+			float v[3] = {e[0]-a[0], e[1]-a[1], e[2]-a[2]};
+			// clockwise face has this cross product pointing outwards
+			float f[3] = {u[1]*v[2] - u[2]*v[1], u[2]*v[0] - u[0]*v[2],
+				u[0]*v[1] - u[1]*v[0]};
+			float s = sqrt(f[0]*f[0] + f[1]*f[1] + f[2]*f[2]);
+			for(k = 0; k < 3; k++) {
+				nrm[k] += f[k];
+				p[k] += (a[k] + b[k] + e[k])/3*s;
+			}
+			area += s;
+		}
+		float l = sqrt(nrm[0]*nrm[0] + nrm[1]*nrm[1] + nrm[2]*nrm[2]);
+		c[total].first = i;
+		c[total].total = j-i;
+		c[total].key = 0;
+		if(area > 0 && l > 0) {
+			for(k = 0; k < 3; k++)
+				c[total].key += (p[k]/area - center[k])*nrm[k]/l;
+		}
+		total++;
+	}
+
+	qsort(c, total, sizeof(Cluster), cluster_cmp);
+	for(i = 0, k = 0; i < total; i++)
+		for(j = 0; j < c[i].total; j++) sorted[k++] = order[c[i].first+j];
+	memcpy(order, sorted, n*sizeof(int));
+
+	free(c);
+	free(sorted);
+}
+
+int mesh_optimize(Mesh *m, char *path) {
+	int i, j, count = m->h->indices - m->h->indices%3, n = count/3;
+	int vertices = m->h->vertices;
+	Uint32 *x = mesh_indices(m);
+	int *order = (int*)malloc(n*sizeof(int) + 1);
+	Uint8 *boundary = (Uint8*)malloc(n + 1);
+
+	tipsify(count, x, vertices, order, boundary);
+	order_clusters(n, x, m->xyz, order, boundary);
+
+	// vertices are renumbered in order of first use, so they are fetched
+	// sequentially (unused ones are dropped)
+	int *remap = (int*)malloc(vertices*sizeof(int) + 1);
+	Uint32 *y = (Uint32*)malloc(count*sizeof(Uint32) + 1);
+	int used = 0;
+	for(i = 0; i < vertices; i++) remap[i] = -1;
+	for(i = 0; i < n; i++) {
+		for(j = 0; j < 3; j++) {
+			int v = x[order[i]*3+j];
+			if(remap[v] < 0) remap[v] = used++;
+			y[i*3+j] = remap[v];
+		}
+	}
+
+	float *xyz = (float*)malloc(used*3*sizeof(float) + 1);
+	float *uvs = m->uvs ? (float*)malloc(used*2*sizeof(float) + 1) : 0;
+	float *normals = m->normals ? (float*)malloc(used*3*sizeof(float) + 1) : 0;
+	for(i = 0; i < vertices; i++) {
+		int r = remap[i];
+		if(r < 0) continue;
+		memcpy(xyz + r*3, m->xyz + i*3, 3*sizeof(float));
+		if(uvs) memcpy(uvs + r*2, m->uvs + i*2, 2*sizeof(float));
+		if(normals) memcpy(normals + r*3, m->normals + i*3, 3*sizeof(float));
+	}
+
+	int ok = write_mesh(path, used, xyz, uvs, normals, count, y);
+
+	free(x);
+	free(y);
+	free(order);
+	free(boundary);
+	free(remap);
+	free(xyz);
+	free(uvs);
+	free(normals);
+	return ok;
+}
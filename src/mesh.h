@@ -0,0 +1,49 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <SDL.h>
+
+#define MESH_MAGIC		0x4d443344 /* "D3DM" */
+#define MESH_VERSION	1
+#define MESH_ALIGN		16 /* streams start at multiples of it */
+#define MESH_CACHE		16 /* vertices in modelled FIFO vertex cache */
+
+// binary mesh file starts with this header, followed by vertex streams
+// and indices. Data is in native byte order and drawn from mapping as is
+typedef struct {
+	Uint32 magic, version;
+	Uint32 type;			// primitive type, D3D_TRIANGLES
+	Uint32 vertices;
+	Uint32 indices;
+	Uint32 index_size;		// 2 or 4 bytes
+	float min[3], max[3];	// bounding box
+	Uint32 xyz;				// file offsets of streams, 0 if missing
+	Uint32 normals;
+	Uint32 uvs;
+	Uint32 index;
+} MeshHeader;
+
+typedef struct {
+	void *map;
+	int size;
+	MeshHeader *h;
+	float *xyz, *normals, *uvs;
+	void *index;
+} Mesh;
+
+// 0 if file is missing, broken or has more than D3D_MAX_VERTICES vertices
+// or D3D_MAX_FACES triangles
+Mesh *mesh_load(char *path);
+void mesh_draw(Mesh *m);
+void mesh_free(Mesh *m);
+
+// convert Wavefront OBJ file into binary mesh, returns 0 on failure
+int mesh_import_obj(char *obj, char *mesh);
+
+// write mesh to 'path' with triangles ordered for vertex cache and then
+// overdraw, and vertices in order of use, returns 0 on failure
+int mesh_optimize(Mesh *m, char *path);
+// average cache misses per triangle for FIFO of MESH_CACHE vertices
+float mesh_acmr(Mesh *m);
+
+#endif
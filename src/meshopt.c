@@ -0,0 +1,85 @@
+/*
+** Copyright (C) 2006 Exa
+** This code is free software; you can redistribute it and/or
+** modify it under the terms of GNU Lesser General Public License.
+*/
+
+
+// reorders binary mesh for vertex cache and overdraw, reporting both
+
+#include <math.h>
+#include <stdio.h>
+
+#include "sdld3d.h"
+#include "mesh.h"
+
+#define VIEWS 16
+
+// ratio of pixels shaded to pixels covered, averaged over viewpoints
+// around mesh, as our rasterizer draws it
+static float overdraw(Mesh *m, SDL_Surface *screen) {
+	MeshHeader *h = m->h;
+	int i, j, shaded = 0, covered = 0;
+
+	float cx = (h->min[0] + h->max[0])/2;
+	float cy = (h->min[1] + h->max[1])/2;
+	float cz = (h->min[2] + h->max[2])/2;
+	float dx = h->max[0]-cx, dy = h->max[1]-cy, dz = h->max[2]-cz;
+	float r = sqrt(dx*dx + dy*dy + dz*dz);
+	if(r <= 0) return 0;
+
+	D3D_SetScreen(screen);
+	D3D_SetMapper(D3D_SOLID);
+	D3D_Enable(D3D_ZTEST|D3D_CULLING);
+	D3D_Color(1, 1, 1);
+
+	for(i = 0; i < VIEWS; i++) {
+		D3D_ClearScreen(0, 0, 0);
+		D3D_ClearZBuffer();
+
+		// mesh is fit into sphere, which is looked at from two heights
+		D3D_LoadIdentity();
+		D3D_Translate(0, 0, 400);
+		D3D_Rotate(i%2 ? 30 : -30, i/2*360.0f/(VIEWS/2), 0);
+		D3D_Scale(100/r, 100/r, 100/r);
+		D3D_Translate(-cx, cy, -cz);
+
+		D3D_BeginQuery();
+		mesh_draw(m);
+		D3D_EndQuery();
+		shaded += D3D_GetQueryResult();
+
+		for(j = 0; j < screen->h; j++) {
+			Uint32 *p = (Uint32*)((Uint8*)screen->pixels + j*screen->pitch);
+			int x;
+			for(x = 0; x < screen->w; x++) covered += p[x] != 0;
+		}
+	}
+	return covered ? (float)shaded/covered : 0;
+}
+
+int main(int argc, char **argv) {
+	if(argc != 3) {
+		printf("usage: %s input.mesh output.mesh\n", argv[0]);
+		return -1;
+	}
+
+	SDL_Surface *screen = SDL_CreateRGBSurface(SDL_SWSURFACE, 640, 480, 32,
+		0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
+	D3D_Init();
+
+	Mesh *m = mesh_load(argv[1]);
+	if(!m) return -1;
+	float acmr = mesh_acmr(m), od = overdraw(m, screen);
+	if(!mesh_optimize(m, argv[2])) return -1;
+	mesh_free(m);
+
+	m = mesh_load(argv[2]);
+	if(!m) return -1;
+	printf("ACMR %.3f -> %.3f (FIFO of %d)\n", acmr, mesh_acmr(m), MESH_CACHE);
+	printf("overdraw %.3f -> %.3f (%d views)\n", od, overdraw(m, screen), VIEWS);
+	mesh_free(m);
+
+	D3D_Quit();
+	return 0;
+}
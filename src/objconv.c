@@ -0,0 +1,27 @@
+/*
+** Copyright (C) 2006 Exa
+** This code is free software; you can redistribute it and/or
+** modify it under the terms of GNU Lesser General Public License.
+*/
+
+
+// converts Wavefront OBJ files into binary meshes
+
+#include <stdio.h>
+
+#include "mesh.h"
+
+int main(int argc, char **argv) {
+	if(argc != 3) {
+		printf("usage: %s input.obj output.mesh\n", argv[0]);
+		return -1;
+	}
+	if(!mesh_import_obj(argv[1], argv[2])) return -1;
+
+	Mesh *m = mesh_load(argv[2]);
+	if(!m) return -1;
+	printf("%d vertices, %d triangles, %d-bit indices\n", m->h->vertices,
+		m->h->indices/3, m->h->index_size*8);
+	mesh_free(m);
+	return 0;
+}
@@ -0,0 +1,308 @@
+/*
+** Copyright (C) 2006 Exa
+** This code is free software; you can redistribute it and/or
+** modify it under the terms of GNU Lesser General Public License.
+*/
+
+
+// replays capture into off-screen surface, timing and hashing its frames
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdld3d.h"
+#include "capture.h"
+
+#define MAX_TEXTURES	4096
+
+static char *path;
+static Uint32 *data, *data_end;
+static SDL_Surface *screen;
+static SDL_Surface *textures[MAX_TEXTURES]; // by id, made by first run
+static int depth; // matrices pushed by capture
+static int forced; // flags kept on, whatever capture sets
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec*1e3 + t.tv_nsec/1e6;
+}
+
+static void broken() {
+	printf("'%s' is not a valid capture\n", path);
+	exit(-1);
+}
+
+// capture is cut short, unless 'n' words are left from 'p'. Program may
+// be killed, while it writes it
+static void need(Uint32 *p, Uint64 n) {
+	if(n > (Uint64)(data_end - p)) broken();
+}
+
+// words of arguments of records, which have fixed size
+static int record_words(Uint32 op) {
+	switch(op) {
+	case CAPTURE_ENABLE: case CAPTURE_DISABLE: case CAPTURE_BEGIN:
+	case CAPTURE_BEGIN_STATIC: case CAPTURE_SET_TEXTURE: case CAPTURE_MAPPER:
+	case CAPTURE_DEPTH_BITS: case CAPTURE_TILED: case CAPTURE_FRONT_FACE:
+	case CAPTURE_PERSPECTIVE: case CAPTURE_NEAR_CLIP:
+		return 1;
+	case CAPTURE_RESOLUTION: case CAPTURE_TEX_COORD:
+		return 2;
+	case CAPTURE_CLEAR_SCREEN: case CAPTURE_SCALE: case CAPTURE_TRANSLATE:
+	case CAPTURE_ROTATE: case CAPTURE_AMBIENT: case CAPTURE_NORMAL:
+	case CAPTURE_LIGHT: case CAPTURE_VERTEX:
+		return 3;
+	case CAPTURE_COLOR: return 4;
+	case CAPTURE_SCREEN: return 7;
+	case CAPTURE_LOAD_MATRIX: return 16;
+	case CAPTURE_TEXTURE: return sizeof(CaptureTexture)/4; // header only
+	case CAPTURE_ELEMENTS: return sizeof(CaptureElements)/4;
+	}
+	return 0;
+}
+
+static Uint32 *load(char *name) {
+	path = name;
+	FILE *f = fopen(path, "rb");
+	if(!f) {
+		printf("cant open '%s'\n", path);
+		exit(-1);
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = (Uint32*)malloc(size + 4);
+	if(size < 8 || fread(data, 1, size, f) != size) broken();
+	fclose(f);
+
+	data_end = data + size/4;
+	if(data[0] != CAPTURE_MAGIC || data[1] != CAPTURE_VERSION) broken();
+	return data + 2;
+}
+
+// FNV-1a of visible pixels
+static Uint32 hash_screen() {
+	Uint32 h = 2166136261u;
+	int x, y, n = screen->w*screen->format->BytesPerPixel;
+	for(y = 0; y < screen->h; y++) {
+		Uint8 *p = (Uint8*)screen->pixels + y*screen->pitch;
+		for(x = 0; x < n; x++) h = (h ^ p[x])*16777619;
+	}
+	return h;
+}
+
+static Uint32 *make_texture(Uint32 *p) {
+	CaptureTexture *h = (CaptureTexture*)p;
+	int y;
+
+	p += sizeof(CaptureTexture)/4;
+	need(p, h->colors + ((Uint64)h->pitch*h->h + 3)/4);
+	if(h->id >= MAX_TEXTURES) {
+		printf("too many textures in capture\n");
+		exit(-1);
+	}
+	if(!textures[h->id]) {
+		SDL_Surface *t = SDL_CreateRGBSurface(SDL_SWSURFACE, h->w, h->h,
+			h->bpp, h->rmask, h->gmask, h->bmask, h->amask);
+		SDL_Palette *pal = t ? t->format->palette : 0;
+		if(!t || (h->colors && (!pal || h->colors > pal->ncolors))) broken();
+		if(h->colors) memcpy(pal->colors, p, h->colors*4);
+		Uint8 *src = (Uint8*)(p + h->colors);
+		for(y = 0; y < h->h; y++) {
+			memcpy((Uint8*)t->pixels + y*t->pitch, src + y*h->pitch,
+				t->pitch < h->pitch ? t->pitch : h->pitch);
+		}
+		textures[h->id] = t;
+	}
+	return p + h->colors + (h->pitch*h->h + 3)/4;
+}
+
+static Uint32 *draw_elements(Uint32 *p) {
+	CaptureElements *h = (CaptureElements*)p;
+	float *xyz = (float*)(p + sizeof(CaptureElements)/4), *normals = 0, *uvs = 0;
+
+	need((Uint32*)xyz, (Uint64)h->vertices*(3 + (h->normals ? 3 : 0) +
+		(h->uvs ? 2 : 0)) + ((Uint64)h->count*h->index_size + 3)/4);
+	p = (Uint32*)xyz + h->vertices*3;
+	if(h->normals) {
+		normals = (float*)p;
+		p += h->vertices*3;
+	}
+	if(h->uvs) {
+		uvs = (float*)p;
+		p += h->vertices*2;
+	}
+	D3D_VertexArrays(h->vertices, xyz, normals, uvs);
+	D3D_DrawElements(h->type, h->count, h->index_size, p);
+	return p + (h->count*h->index_size + 3)/4;
+}
+
+// replay whole capture once, 'times' and 'hashes' get one entry per frame
+static int replay(Uint32 *p, float *times, Uint32 *hashes) {
+	float *f;
+	int frames = 0;
+	double start = now();
+
+	while(p < data_end) {
+		Uint32 op = *p++;
+		f = (float*)p;
+		need(p, record_words(op));
+		switch(op) {
+		case CAPTURE_FRAME:
+			D3D_Flush();
+			if(times) times[frames] = now() - start;
+			if(hashes) hashes[frames] = hash_screen();
+			frames++;
+			start = now();
+			break;
+		case CAPTURE_INIT: D3D_Init(); break; // resets state, it's recorded once
+		case CAPTURE_ENABLE: D3D_Enable(*p++); break;
+		case CAPTURE_DISABLE: D3D_Disable(*p++ & ~forced); break;
+		case CAPTURE_CLEAR_SCREEN: D3D_ClearScreen(f[0], f[1], f[2]); p += 3; break;
+		case CAPTURE_CLEAR_ZBUFFER: D3D_ClearZBuffer(); break;
+		case CAPTURE_CLEAR_LIGHTS: D3D_ClearLights(); break;
+		case CAPTURE_BEGIN_QUERY: D3D_BeginQuery(); break;
+		case CAPTURE_END_QUERY: D3D_EndQuery(); break;
+		case CAPTURE_PUSH: D3D_Push(); depth++; break;
+		case CAPTURE_POP: D3D_Pop(); depth--; break;
+		case CAPTURE_LOAD_IDENTITY: D3D_LoadIdentity(); break;
+		case CAPTURE_LOAD_MATRIX: D3D_LoadMatrix(f); p += 16; break;
+		case CAPTURE_SCALE: D3D_Scale(f[0], f[1], f[2]); p += 3; break;
+		case CAPTURE_TRANSLATE: D3D_Translate(f[0], f[1], f[2]); p += 3; break;
+		case CAPTURE_ROTATE: D3D_Rotate(f[0], f[1], f[2]); p += 3; break;
+		case CAPTURE_BEGIN: D3D_Begin(*p++); break;
+		case CAPTURE_END: D3D_End(); break;
+		case CAPTURE_FLUSH: D3D_Flush(); break;
+		case CAPTURE_PRESENT: D3D_Present(); break;
+		// calls, which draw static layer, are recorded only where program
+		// drew it, so replay draws it there too. Elsewhere it restores it
+		// as program did, since capture starts with snapshot invalid
+		case CAPTURE_BEGIN_STATIC:
+			if(*p++) D3D_InvalidateStatic();
+			D3D_BeginStatic();
+			break;
+		case CAPTURE_END_STATIC: D3D_EndStatic(); break;
+		case CAPTURE_INVALIDATE_STATIC: D3D_InvalidateStatic(); break;
+		case CAPTURE_REDRAW: D3D_Redraw(); break;
+		case CAPTURE_SCREEN:
+			// program may render into several surfaces, replay uses one
+			if(!screen || screen->w != p[0] || screen->h != p[1]) {
+				if(screen) SDL_FreeSurface(screen);
+				screen = SDL_CreateRGBSurface(SDL_SWSURFACE, p[0], p[1],
+					p[2], p[3], p[4], p[5], p[6]);
+			}
+			D3D_SetScreen(screen);
+			p += 7;
+			break;
+		case CAPTURE_TEXTURE: p = make_texture(p); break;
+		case CAPTURE_SET_TEXTURE:
+			if(*p >= MAX_TEXTURES) broken();
+			D3D_SetTexture(textures[*p++]);
+			break;
+		case CAPTURE_MAPPER: D3D_SetMapper(*p++); break;
+		case CAPTURE_DEPTH_BITS: D3D_SetDepthBits(*p++); break;
+		case CAPTURE_TILED: D3D_SetTiled(*p++); break;
+		case CAPTURE_RESOLUTION: D3D_SetResolution(f[0], f[1]); p += 2; break;
+		case CAPTURE_AMBIENT: D3D_SetAmbient(f[0], f[1], f[2]); p += 3; break;
+		case CAPTURE_FRONT_FACE: D3D_FrontFace(*p++); break;
+		case CAPTURE_PERSPECTIVE: D3D_SetPerspective(*p++); break;
+		case CAPTURE_NEAR_CLIP: D3D_SetNearClip(f[0]); p++; break;
+		case CAPTURE_COLOR: D3D_Color4(f[0], f[1], f[2], f[3]); p += 4; break;
+		case CAPTURE_NORMAL: D3D_Normal(f[0], f[1], f[2]); p += 3; break;
+		case CAPTURE_TEX_COORD: D3D_TexCoord(f[0], f[1]); p += 2; break;
+		case CAPTURE_LIGHT: D3D_Light(f[0], f[1], f[2]); p += 3; break;
+		case CAPTURE_VERTEX: D3D_Vertex(f[0], f[1], f[2]); p += 3; break;
+		case CAPTURE_ELEMENTS: p = draw_elements(p); break;
+		default:
+			printf("unknown opcode %u in capture\n", op);
+			exit(-1);
+		}
+	}
+	// next run starts with matrix stack, it started with
+	D3D_Flush();
+	for(; depth > 0; depth--) D3D_Pop();
+	return frames;
+}
+
+static int float_cmp(const void *a, const void *b) {
+	float x = *(float*)a, y = *(float*)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+	int runs = 10, flags = 0, i, j, frames, mismatches = 0;
+
+	for(i = 2; i < argc; i++) {
+		if(!strcmp(argv[i], "-n") && i+1 < argc) runs = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-f") && i+1 < argc)
+			flags = strtol(argv[++i], 0, 0);
+		else break;
+	}
+	if(argc < 2 || i < argc) {
+		printf("usage: %s capture [-n runs] [-f flags]\n"
+			"  -f  replay again with D3D_Enable flags forced on, such as\n"
+			"      0x20 for depth pre-pass, and report frames, which differ\n",
+			argv[0]);
+		return -1;
+	}
+	if(runs < 1) runs = 1;
+
+	Uint32 *start = load(argv[1]);
+	D3D_Init();
+
+	// used, unless capture sets screen
+	screen = SDL_CreateRGBSurface(SDL_SWSURFACE, 640, 480, 32,
+		0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
+	D3D_SetScreen(screen);
+
+	// first run makes textures and counts frames
+	frames = replay(start, 0, 0);
+	if(!frames) {
+		printf("capture has no frames\n");
+		return -1;
+	}
+
+	float *times = (float*)malloc(runs*frames*sizeof(float));
+	Uint32 *hashes = (Uint32*)malloc(runs*frames*sizeof(Uint32));
+	for(i = 0; i < runs; i++)
+		replay(start, times + i*frames, hashes + i*frames);
+
+	// every run should give the same pictures
+	printf("frame     hash  min ms  median ms\n");
+	float *t = (float*)malloc(runs*sizeof(float));
+	double total = 0;
+	for(j = 0; j < frames; j++) {
+		int same = 1;
+		for(i = 0; i < runs; i++) {
+			t[i] = times[i*frames + j];
+			total += t[i];
+			if(hashes[i*frames + j] != hashes[j]) same = 0;
+		}
+		qsort(t, runs, sizeof(float), float_cmp);
+		printf("%5d %08x %7.3f %10.3f%s\n", j, hashes[j], t[0], t[runs/2],
+			same ? "" : "  hash differs between runs");
+		mismatches += !same;
+	}
+	printf("%d frames, %d runs, mean %.3f ms per frame\n", frames, runs,
+		total/(runs*frames));
+
+	// modes, which defer or reorder drawing, should give same pictures
+	if(flags) {
+		Uint32 *forced_hashes = (Uint32*)malloc(frames*sizeof(Uint32));
+		forced = flags;
+		D3D_Enable(forced);
+		replay(start, 0, forced_hashes);
+		for(j = 0; j < frames; j++) {
+			if(forced_hashes[j] == hashes[j]) continue;
+			printf("frame %d differs with flags 0x%x\n", j, flags);
+			mismatches++;
+		}
+		free(forced_hashes);
+	}
+
+	D3D_Quit();
+	return mismatches ? 1 : 0;
+}
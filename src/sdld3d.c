@@ -11,8 +11,17 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <SDL/SDL_thread.h>
+#include <SDL/SDL_image.h>
 
 #include "sdld3d.h"
+#include "trace.h"
+#include "capture.h"
 
 typedef struct {
 	float x, y, z, r, g, b;
@@ -26,8 +35,8 @@ typedef struct {
 #define IPLS 12
 
 typedef struct {
-	float i[IPLS]; // z, u, v, r, g, b, n[x,y,z], a, x, y
-} Vertex;
+	float i[IPLS]; // r, g, b, a, u, v, z, x, y, n[x,y,z]
+} __attribute__((aligned(16))) Vertex;
 
 #define MODULE(x) ((x) >= 0 ? (x) : -(x))
 #define ABS(x) ((MODULE(x) > 0.000001) ? MODULE(x) : 1)
@@ -37,8 +46,8 @@ typedef struct {
 #define MAX(a,b) (((a) < (b)) ? (b) : (a))
 
 // max vertex_buffer available to render between D3D_Begin and D3D_End
-#define MAX_VERTICES		100000
-#define MAX_FACES			(MAX_VERTICES-2)
+#define MAX_VERTICES		D3D_MAX_VERTICES
+#define MAX_FACES			D3D_MAX_FACES
 #define MAX_MATRICES		100
 #define MAX_LIGHTS			1000
 
@@ -47,44 +56,58 @@ typedef struct {
 
 // following macros help us to make iterpolant-member
 // access more illustrative
-#define U(l) ((l) -> i[0])
-#define V(l) ((l) -> i[1])
-#define R(l) ((l) -> i[2])
-#define G(l) ((l) -> i[3])
-#define B(l) ((l) -> i[4])
-#define A(l) ((l) -> i[5])
-#define NX(l) ((l) -> i[6])
-#define NY(l) ((l) -> i[7])
-#define NZ(l) ((l) -> i[8])
-#define Z(l) ((l) -> i[9])
-#define X(l) ((l) -> i[IPLS-2])
-#define Y(l) ((l) -> i[IPLS-1])
-
-#define UD(l) ((l) -> s[0])
-#define VD(l) ((l) -> s[1])
-#define RD(l) ((l) -> s[2])
-#define GD(l) ((l) -> s[3])
-#define BD(l) ((l) -> s[4])
-#define AD(l) ((l) -> s[5])
-#define NXD(l) ((l) -> s[6])
-#define NYD(l) ((l) -> s[7])
-#define NZD(l) ((l) -> s[8])
-#define ZD(l) ((l) -> s[9])
-#define XD(l) ((l) -> s[IPLS-2])
-#define YD(l) ((l) -> s[IPLS-1])
+// NOTE: 1/z and varyings (color and texture coords) go first, packed in
+// order of importance, so ones required by current state always form
+// a prefix of 'nipls' elements
+#define Z(l) ((l) -> i[0])
+#define R(l) ((l) -> i[1])
+#define G(l) ((l) -> i[2])
+#define B(l) ((l) -> i[3])
+#define A(l) ((l) -> i[4])
+#define U(l) ((l) -> i[5])
+#define V(l) ((l) -> i[6])
+#define X(l) ((l) -> i[7])
+#define Y(l) ((l) -> i[8])
+#define NX(l) ((l) -> i[9])
+#define NY(l) ((l) -> i[10])
+#define NZ(l) ((l) -> i[11])
+
+#define ZD(l) ((l) -> s[0])
+#define RD(l) ((l) -> s[1])
+#define GD(l) ((l) -> s[2])
+#define BD(l) ((l) -> s[3])
+#define AD(l) ((l) -> s[4])
+#define UD(l) ((l) -> s[5])
+#define VD(l) ((l) -> s[6])
+
+// interpolants, which are stepped across triangle (z and varyings)
+#define LERP_IPLS			8
+
+// varying masks, used to work out which interpolants rasterizer needs
+#define VARYING_COLOR		0x01 /* r, g, b, a */
+#define VARYING_UV			0x02 /* u, v */
+
+// vertex positions on screen are snapped to 28.4 fixed point
+#define SUBPIXEL_BITS		4
+#define SUBPIXEL			(1<<SUBPIXEL_BITS)
+
+// triangles are clipped, where they reach further off-screen, so that
+// fixed point edge setup can't overflow
+#define GUARD_BAND			(1<<20)
 
 // next structure is for linear interpolation of components across triangle
 typedef struct lerp {
-	float i[IPLS-1];	// interpolants
-	float s[IPLS-1];	// steps - one for each interpolant
-} lerp;
+	float i[LERP_IPLS];	// interpolants
+	float s[LERP_IPLS];	// steps - one for each interpolant
+} __attribute__((aligned(16))) lerp;
 
 typedef struct {
 	Vertex *a, *b, *c;
-	float nx, ny, nz;	// normal
 } Face;
 
-static SDL_Surface *screen;		// target frame-buffer
+// state, which span kernel works with, is kept by each thread, as views
+// are drawn by threads of their own
+static __thread SDL_Surface *screen;	// target frame-buffer
 static SDL_Surface *texture;	// current texture
 // NOTE: current texture should not change between begin and end
 
@@ -96,15 +119,157 @@ static float rR, rG, rB, rA;	// current color
 static float rNX, rNY, rNZ;		// current normal
 static float rU, rV;			// current texture coords
 
-static float *zbuffer;	// x-buffer (aka 1/x-buffer or w-buffer)
+static __thread float *zbuffer;	// x-buffer (aka 1/x-buffer or w-buffer)
+static int zbuffer_w, zbuffer_h; // size of screen, zbuffer is allocated for
+static int depth_bits = 32; // 16 and 24 bits keep 1/z scaled to near plane
+
+// tiled render target keeps 8x8 pixel tiles in row-major order, each one
+// with its rows in order, so span stays in few cache lines for 8 rows.
+// Depth buffer gets the same layout. Colour is copied to screen by
+// D3D_Present
+#define TILE				8
+static __thread int tiled;	// render into tiles instead of screen
+static Uint8 *tiles;	// colour of tiled target, 4 bytes per pixel
+static int tiles_w;		// row of tiles, in tiles
+
+// frames can be rendered at fraction of screen size into surface of
+// their own, which D3D_Present upscales to screen. Governor picks the
+// fraction by time of recent frames
+#define FRAME_WINDOW		16 /* frames averaged by governor */
+static SDL_Surface *display;	// surface given to D3D_SetScreen
+static SDL_Surface *scaled;		// target of reduced resolution
+static Uint8 *scaled_pixels;
+static int scaled_size;			// bytes allocated for scaled_pixels
+static float res_scale = 1;		// size of target relative to screen
+static int res_filter = D3D_LINEAR; // D3D_NEAREST or D3D_LINEAR
+static float frame_budget;		// ms governor keeps frames in, 0 if off
+static float min_scale;
+static float frame_times[FRAME_WINDOW];
+static int total_frame_times;	// since last change of resolution
+static Uint32 last_present;
+
+// pixel at x, y from start of tiled buffer
+#define TILE_OFFSET(x, y) \
+	((((y)/TILE*tiles_w + (x)/TILE)*TILE + (y)%TILE)*TILE + (x)%TILE)
 
 static int total_lights; // total lights currently in scene
 static Light light_buffer[MAX_LIGHTS];
 
+// static layer is snapshot of colour and depth, which is restored instead
+// of drawing static geometry again, while what it was drawn with is same
+typedef struct {
+	float matrix[16];
+	float near_clip;
+	int w, h, bpp;
+	int depth_bits, tiled;
+	int total_lights;
+	// rasterizer state, which layer starts with
+	SDL_Surface *texture;
+	void *pixels;		// they change, when texture is swapped in
+	int mapper, flags, perspective, front_face;
+	float ambient_r, ambient_g, ambient_b;
+} StaticKey;
+
+static StaticKey static_key;
+static Light static_lights[MAX_LIGHTS];
+static Uint8 *static_color, *static_depth;
+static int static_color_size, static_depth_size; // bytes allocated
+static int static_valid;	// snapshot was taken with static_key
+static int static_drawing;	// static layer is drawn until D3D_EndStatic
+
+// lights are versioned by slot, so that baked lighting redoes only the
+// ones, which changed. Slot keeps its light over D3D_ClearLights, and
+// version isn't bumped, when same light is set into it again
+static Uint32 lights_version;
+static Uint32 light_versions[MAX_LIGHTS]; // at which slot was set last
+static int max_set_lights;	// slots, which were ever set
+
+// light, which vertex arrays got with D3D_BAKE_LIGHTS, is kept along
+// with lights it was summed from. Arrays are told apart by address
+#define BAKED_MESHES		32
+#define BAKED_UPDATES		64 /* partial updates before full one */
+
+typedef struct {
+	float *xyz;			// 0 for free entry
+	int vertices;
+	float matrix[16];
+	Uint32 version;		// lights_version, it was lit at
+	Light *lights;		// lights it has, 'total_lights' of them
+	int total_lights, max_lights;
+	float *light;		// r, g, b summed for each vertex
+	int max_light;
+	int updates;		// partial ones since full
+	int used;
+} BakedMesh;
+
+static BakedMesh baked[BAKED_MESHES];
+static int baked_clock;
+static float *baking_xyz;	// arrays drawn with D3D_BAKE_LIGHTS, if any
+
 static int total_vertices;	// total vertices between D3D_Begin and D3D_End
 
 static Vertex vertex_buffer[MAX_VERTICES];
 static Face face_buffer[MAX_FACES];
+static Uint8 vertex_used[MAX_VERTICES]; // referenced by visible faces
+
+// faces with their depth keys, radix sorted back and forth between halves
+typedef struct {
+	Uint32 key;
+	Face face;
+} SortedFace;
+static SortedFace sorted_faces[2][MAX_FACES];
+
+// textures are kept in BGRA byte order, which span kernel assumes
+static SDL_PixelFormat texture_format = {
+	0, 32, 4,			// palette, bits and bytes per pixel
+	0, 0, 0, 0,			// losses
+	16, 8, 0, 24,		// shifts
+	0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, // masks
+	0, 0xff				// colorkey, alpha
+};
+
+// textures are decoded by pool of threads and swapped into placeholders,
+// given out by D3D_LoadTextureAsync, when frame is flushed
+#define LOADER_THREADS 4
+
+typedef struct LoadJob {
+	char *path;
+	SDL_Surface *target;	// placeholder, which user holds
+	SDL_Surface *result;	// decoded texture, 0 if it failed to load
+	struct LoadJob *next;
+} LoadJob;
+
+static SDL_Thread *loaders[LOADER_THREADS];
+static SDL_mutex *load_lock;	// guards both lists of jobs
+static SDL_sem *load_jobs;		// counts queued jobs
+static LoadJob *queued, **queued_end = &queued; // jobs in order of requests
+static LoadJob *loaded;			// jobs to be swapped in
+static int pending_textures;	// requested, but not swapped in yet
+
+// converted textures are cached in files, which are mapped on later runs
+// and sampled in place. File is named by hash of source path, while its
+// header keeps everything, which makes cached copy stale
+#define CACHE_MAGIC			0x54443344 /* "D3DT" */
+#define CACHE_VERSION		1
+#define CACHE_DATA			4096 /* offset of pixels, page aligned */
+
+typedef struct {
+	Uint32 magic, version;
+	Uint32 mtime, size;		// of source image
+	Uint32 bpp, rmask, gmask, bmask, amask; // texture format
+	Uint32 w, h, pitch;
+	char path[1024];		// source image, in case of hash collision
+} CacheHeader;
+
+typedef struct Mapping {
+	void *addr;
+	size_t length;
+	struct Mapping *next;
+} Mapping;
+
+static char *cache_dir;			// 0 if cache is disabled
+static SDL_mutex *cache_lock;	// guards mappings
+static Mapping *mappings;		// cached textures in use, freed by D3D_Quit
 
 static int current_matrix;	// top matrix in stack
 static float matrix_stack[MAX_MATRICES][16];	// matrix stack
@@ -113,14 +278,185 @@ static float *tmatrix = matrix_stack[0];		// transformation matrix
 // ambient glow
 static float ambient_r, ambient_g, ambient_b;
 
-static int ntriangles;	// number of triangles rendered so far
+static __thread D3D_Stats stats;	// what was rendered since D3D_ResetStats
+
+static int query_active;	// between D3D_BeginQuery and D3D_EndQuery
+static __thread int query_pixels; // pixels passed z-test, counted by span kernel
+
+// public calls are recorded, while capture is open. Textures are written
+// once, when they are set first, and again, whenever their pixels change
+typedef struct {
+	SDL_Surface *surface;
+	void *pixels;		// texture is written again, if these change
+	int w, h;
+	int id;
+} CapturedTexture;
+
+static FILE *capture;	// 0 unless capturing
+static CapturedTexture *captured;
+static int total_captured, max_captured;
+
+static void record(Uint32 op, void *args, int n) {
+	fwrite(&op, 4, 1, capture);
+	if(n) fwrite(args, 4, n, capture);
+}
+
+// only public entry points record, calls renderer makes itself go through
+// internal functions, so they don't show up in capture
+#define RECORD(op, type, ...) do { if(capture) { \
+	type a_[] = {__VA_ARGS__}; record(op, a_, sizeof(a_)/4); } } while(0)
+#define RECORD0(op) do { if(capture) record(op, 0, 0); } while(0)
+
+// rasterizer state, which is kept along with deferred batches
+typedef struct {
+	SDL_Surface *texture;
+	int mapper;
+	int flags;
+	int perspective;
+	float ambient_r, ambient_g, ambient_b;
+} RasterState;
+
+// batch, which rasterization was deferred until D3D_Flush
+typedef struct {
+	RasterState state;
+	int first_vertex;	// in frame_vertices
+	int first_face;		// in frame_faces
+	int total_faces;
+	int depth_done;		// its depth was laid down by pre-pass
+	int spans_done;		// its visible spans are in span buffer
+	int counted;		// its pixels go to query, when it is rasterized
+} Batch;
+
+typedef struct {
+	int a, b, c;	// indices of batch vertices
+} FaceIndex;
+
+// deferred batches along with copies of their vertices and faces
+static Batch *batches;
+static int total_batches, max_batches;
+static Vertex *frame_vertices;
+static int total_frame_vertices, max_frame_vertices;
+static FaceIndex *frame_faces;
+static int total_frame_faces, max_frame_faces;
+
+// span buffer keeps, for each scanline, list of non-overlapping spans
+// sorted by 'x', along with face, which is visible there
+typedef struct {
+	int x0, x1;		// pixels [x0, x1) of scanline
+	int face;		// in frame_faces
+	float z, dz;	// 1/z of face at pixel 'x' is z + dz*x
+	int next;		// span on the right, -1 at the end
+} SBufferSpan;
+
+#define SBUFFER_INSERT	1 /* scanlines of faces are inserted into buffer */
+#define SBUFFER_SHADE	2 /* only spans, where face is visible, are drawn */
+
+static SBufferSpan *sbuffer;
+static int total_sbuffer, max_sbuffer;
+static int *sbuffer_rows;	// first span of each scanline
+static int sbuffer_h, max_sbuffer_rows; // scanlines in use, 0 if empty
+static int sbuffer_pass;	// what draw_face does with scanlines
+static int sbuffer_face;	// face being inserted or shaded
+static int depth_kept;		// spans write and test depth until it's cleared
+
+// memoized frame is kept until D3D_Present, along with clears, which are
+// done before batch 'batches' of it
+typedef struct {
+	int batches;
+	int zbuffer;	// depth is cleared, instead of colour
+	Uint32 color;
+} FrameOp;
+
+#define FRAME_HASH_SEED 14695981039346656037ULL
+
+static FrameOp *frame_ops;
+static int total_frame_ops, max_frame_ops;
+static Uint64 frame_hash = FRAME_HASH_SEED; // of what was submitted since D3D_Present
+static Uint64 last_frame_hash;
+static int last_frame_valid; // last frame was hashed entirely
+static int frame_drawing;	// frame is drawn as it goes, so it isn't skipped
+static int frame_redraw;	// D3D_Redraw was called
+
+#define MEMOIZING() ((flags & D3D_MEMOIZE) && !frame_drawing)
+
+// view has its own camera, target and depth buffer. Faces are moved into
+// it from space, they were lit in, and drawn by its thread, if it has one
+#define MAX_VIEWS			8
+
+typedef struct {
+	float matrix[16];
+	SDL_Surface *target;
+	float *zbuffer;
+	int zbuffer_size;	// bytes allocated
+	Vertex *vertices;	// vertex_buffer in view space
+	int max_vertices;
+	Face *faces;		// faces to draw, which refer to 'vertices'
+	int total_faces, max_faces;
+	SDL_Thread *thread;
+	SDL_sem *start, *done;
+	int quit;
+	D3D_Stats stats;	// drawn by its thread
+	int query_pixels;
+} View;
+
+static View views[MAX_VIEWS];
+static int total_views;		// 0 unless D3D_SetViews is in effect
+static int views_span_flags; // span_flags of faces, which views draw
 static int draw_type;	// type of drawing - D3D_LINES, D3D_TRIANGLES, etc...
 static float near_clip = 100.0f; // aka projection plane aka viewing plane
 //static float far_clip = 10000.0f;
 
 static int mapper;		// determines texture mapping method
+static int front_face = D3D_CW; // winding of faces turned to viewer
+static int perspective = D3D_AFFINE; // perspective correction mode
+static int run_length;	// pixels between perspective divides, 0 for span
 static int flags;		// flags, that control rendering behaviour
 
+static int varyings;	// mask of varyings used by rasterizer
+static int nipls;		// number of interpolants in use (z and varyings)
+static __thread int span_flags;	// flags passed to span drawing kernel
+
+// span kernel flags, which aren't user-visible (they are placed above
+// D3D_Enable flags, because kernel tests both with the same register)
+#define SPAN_TEXTURE		0x10000 /* fetch texel, otherwise it is white */
+#define SPAN_ZEQUAL			0x20000 /* pass z-test on equal depth only */
+#define SPAN_NOCOLOR		0x40000 /* stop after z-test, leaving color */
+#define SPAN_ZKEEP			0x80000 /* don't save depth of passed pixels */
+#define SPAN_COUNT			0x100000 /* count pixels passed z-test */
+#define SPAN_PAL8			0x200000 /* texel is index into palette */
+#define SPAN_TEXELS			0x400000 /* texels are fetched for span already */
+#define SPAN_RGB565			0x800000 /* screen has 16-bit pixels */
+#define SPAN_DITHER			0x1000000 /* dither color before it is packed */
+#define SPAN_DEPTH16		0x2000000 /* depth buffer has 16-bit values */
+#define SPAN_DEPTH24		0x4000000 /* 24-bit values over 8 spare bits */
+#define SPAN_TILED			0x8000000 /* screen and depth are in tiles */
+
+// textures in compressed formats are decoded for whole span into this
+// buffer, before it is drawn. Recently decoded blocks are cached
+#define MAX_SPAN			8192
+#define BLOCK_CACHE			256 /* power of two */
+
+static __thread Uint32 span_texels[MAX_SPAN];
+static __thread Uint8 *cached_blocks[BLOCK_CACHE];	// blocks held by cache
+static __thread Uint32 cached_texels[BLOCK_CACHE][16];
+static __thread int cached_generation;	// texture_generation of cache
+static int texture_generation;	// changes, when texture memory can be reused
+
+// 16-bit screen. Color is rounded by ordered dither, thresholds of 4x4
+// Bayer matrix are kept in BGRA words for 5, 6 and 5 bit channels
+static Uint16 dither_matrix[4][4][4];
+
+// words of 565 pixel are moved to top bits and scaled to 8 bits
+static Uint16 unpack_mul[4] = {1 << 11, 1, 1, 0};
+static Uint16 unpack_mask[4] = {0xf800, 0x07e0, 0xf800, 0};
+static Uint16 unpack_scale[4] = {264, 8320, 264, 0}; // 8.25, 4.0625 and 8.25
+// and packed back, shifted left by 3 bits
+static Uint16 pack_mask[4] = {0xf8, 0xfc, 0xf8, 0};
+static Uint16 pack_mul[4] = {1, 1 << 6, 1 << 11, 0};
+
+#define STR_(x) #x
+#define STR(x) STR_(x) // used to paste constants into asm code
+
 /*static void printm(float *m) {
 	int i, j;
 	for(i = 0; i < 4; ++i) {
@@ -131,6 +467,7 @@ static int flags;		// flags, that control rendering behaviour
 }*/
 
 void D3D_Push() {
+	RECORD0(CAPTURE_PUSH);
 	if(++current_matrix == MAX_MATRICES) {
 		printf("matrix stack overflow\n");
 		exit(-1);
@@ -140,6 +477,7 @@ void D3D_Push() {
 }
 
 void D3D_Pop() {
+	RECORD0(CAPTURE_POP);
 	if(!current_matrix) {
 		printf("matrix stack underflow\n");
 		exit(-1);
@@ -239,69 +577,244 @@ void D3D_RotateM(float *m, float x, float y, float z) {
 }
 
 void D3D_LoadIdentity() {
+	RECORD0(CAPTURE_LOAD_IDENTITY);
 	D3D_LoadIdentityM(tmatrix);
 }
 
+void D3D_LoadMatrix(float *m) {
+	if(capture) record(CAPTURE_LOAD_MATRIX, m, 16);
+	matrixcpy(tmatrix, m);
+}
+
 void D3D_Scale(float x, float y, float z) {
+	RECORD(CAPTURE_SCALE, float, x, y, z);
 	D3D_ScaleM(tmatrix, x, y, z);
 }
 
 void D3D_Translate(float x, float y, float z) {
+	RECORD(CAPTURE_TRANSLATE, float, x, y, z);
 	D3D_TranslateM(tmatrix, x, -y, z);
 }
 
 void D3D_Rotate(float x, float y, float z) {
+	RECORD(CAPTURE_ROTATE, float, x, y, z);
 	D3D_RotateM(tmatrix, x, y, z);
 }
 
 
-static void lerp_init_y(lerp *l,  Vertex *s, Vertex *e, int first_step, int nsteps) {
-	int i;
+// span kernel flags, which describe screen and depth buffer
+#define SPAN_BUFFER_FLAGS (SPAN_RGB565|SPAN_DITHER|SPAN_DEPTH16|SPAN_DEPTH24|SPAN_TILED)
+
+static int buffer_flags() {
+	int f = 0;
+	if(screen->format->BytesPerPixel == 2) {
+		f |= SPAN_RGB565;
+		if(flags & D3D_DITHER) f |= SPAN_DITHER;
+	}
+	if(depth_bits == 16) f |= SPAN_DEPTH16;
+	if(depth_bits == 24) f |= SPAN_DEPTH24;
+	if(tiled) f |= SPAN_TILED;
+	return f;
+}
 
-	for(i = 0; i < IPLS-1; ++i) {
-		l->i[i] = s->i[i];
-		l->s[i] = (e->i[i] - s->i[i]) / nsteps;
+// work out, which varyings and span kernel features current state needs
+static void setup_raster() {
+	varyings = VARYING_COLOR;
+	if(mapper != D3D_SOLID && texture) varyings |= VARYING_UV;
+
+	// varyings are packed, so count is given by the last one in use
+	nipls = 1;
+	if(varyings & VARYING_COLOR) nipls = 5;
+	if(varyings & VARYING_UV) nipls = 7;
+
+	span_flags = flags & (D3D_ZTEST|D3D_LIGHTS|D3D_BLENDING);
+	if(varyings & VARYING_UV) {
+		span_flags |= SPAN_TEXTURE;
+		if(texture->format->BitsPerPixel == 8) span_flags |= SPAN_PAL8;
+		if(texture->format->BitsPerPixel == 4) span_flags |= SPAN_TEXELS;
 	}
 
-	if(first_step)
-		for(i = 0; i < IPLS-1; ++i)
-			l->i[i] += first_step*l->s[i];
+	if(flags & D3D_TEST_ONLY) { // nothing is drawn, faces are only tested
+		varyings = 0;
+		nipls = 1;
+		span_flags = (flags & D3D_ZTEST) | SPAN_NOCOLOR | SPAN_ZKEEP;
+	}
+	if(query_active) span_flags |= SPAN_COUNT;
+	span_flags |= buffer_flags();
 }
 
-static void lerp_advance_y(lerp *l) {
-	int i;
-	for(i = 0; i < IPLS-1; ++i) l->i[i] += l->s[i];
+// setup rasterizer to lay down depth only
+static void setup_depth_pass() {
+	varyings = 0;
+	nipls = 1;
+	span_flags = D3D_ZTEST | SPAN_NOCOLOR;
+	if(query_active) span_flags |= SPAN_COUNT;
+	span_flags |= buffer_flags();
 }
 
+// edge of triangle, stepped with exact integer DDA. 'x' is first pixel
+// column having its center on the right of edge at current scanline
+typedef struct {
+	int x;		// ceil(n/d), where n/d is column of edge
+	int err;	// x*d - n, always in [0, d)
+	int xstep;	// floor of x advance per scanline
+	int estep;	// remainder of that advance
+	int d;
+} edge;
+
+static int ceil_div(long long n, long long d) {
+	long long q = n/d;
+	return q + (n%d > 0);
+}
 
-static void lerp_init_x(lerp *l,  lerp *s, lerp *e,
-		int first_step, int nsteps) {
-	int i;
+static int floor_div(long long n, long long d) {
+	long long q = n/d;
+	return q - (n%d < 0);
+}
+
+// init edge going from (x0,y0) down to (x1,y1), which are in 28.4 fixed
+// point, for pixel centers of scanline 'y'
+static void edge_init(edge *e, int x0, int y0, int x1, int y1, int y) {
+	int dx = x1 - x0;
+	int dy = y1 - y0;
+	long long n = (long long)(x0 - SUBPIXEL/2)*dy +
+		(long long)((y << SUBPIXEL_BITS) + SUBPIXEL/2 - y0)*dx;
+
+	e->d = dy << SUBPIXEL_BITS;
+	e->x = ceil_div(n, e->d);
+	e->err = (long long)e->x*e->d - n;
+	e->xstep = floor_div(dx*SUBPIXEL, e->d);
+	e->estep = dx*SUBPIXEL - e->xstep*e->d;
+}
+
+static void edge_advance(edge *e) {
+	e->x += e->xstep;
+	e->err -= e->estep;
+	if(e->err < 0) {
+		e->x++;
+		e->err += e->d;
+	}
+}
 
-	Z(l) = 1/Z(s);
+// plane equations of interpolants over projected triangle
+typedef struct {
+	lerp row;				// values at (0.5, y+0.5) and their steps along y
+	float dx[LERP_IPLS];	// steps along x
+} plane;
 
-	for(i = 0; i < IPLS-3; ++i) {
-		l->i[i] = s->i[i]*Z(l);
-		l->s[i] = (e->i[i]*(1/Z(e)) - l->i[i]) / nsteps;
+static void plane_init(plane *p, Vertex *a, Vertex *b, Vertex *c, float area, int y) {
+	int i;
+	float x1 = X(b) - X(a), y1 = Y(b) - Y(a);
+	float x2 = X(c) - X(a), y2 = Y(c) - Y(a);
+
+	// offset of first pixel center of scanline 'y' from 'a'
+	float ox = 0.5f - X(a);
+	float oy = y + 0.5f - Y(a);
+
+	for(i = 0; i < nipls; ++i) {
+		float d1 = b->i[i] - a->i[i];
+		float d2 = c->i[i] - a->i[i];
+		p->dx[i] = (d1*y2 - d2*y1)/area;
+		p->row.s[i] = (d2*x1 - d1*x2)/area;
+		p->row.i[i] = a->i[i] + p->dx[i]*ox + p->row.s[i]*oy;
 	}
+}
+
+static void lerp_advance_y(lerp *l) {
+	int i;
+	for(i = 0; i < nipls; ++i) l->i[i] += l->s[i];
+}
+
+// setup span interpolation between true values 's' and 'e', which are
+// 'nsteps' pixels away
+static void lerp_init_x(lerp *l, float *s, float *e, int nsteps) {
+	int i;
+	float r = nsteps ? 1.0f/nsteps : 0;
 
-	Z(l) = Z(s);
-	l->s[IPLS-3] = (Z(e) - Z(s))/nsteps;
+	for(i = 0; i < nipls; ++i) {
+		l->i[i] = s[i];
+		l->s[i] = (e[i] - s[i])*r;
+	}
+}
 
-	if(first_step)
-		for(i = 0; i < IPLS-2; ++i)
-			l->i[i] += first_step*l->s[i];
-	//U(l) *= texture->w-1;
-	//V(l) *= texture->h-1;
-	//UD(l) *= texture->w-1;
-	//VD(l) *= texture->h-1;
+// turn 1/z-premultiplied interpolants 'p' into true values 't'
+static void unproject(float *p, float *t, float z) {
+	int i;
+	t[0] = p[0];
+	for(i = 1; i < nipls; ++i) t[i] = p[i]*z;
 }
 
 /*static void lerp_advance_x(lerp *l) {
 	int i;
-	for(i = 0; i < IPLS-2; ++i) l->i[i] += l->s[i];
+	for(i = 0; i < nipls; ++i) l->i[i] += l->s[i];
 }*/
 
+// expand RGB565 into BGRA
+static Uint32 unpack565(Uint32 c) {
+	Uint32 r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	return 0xff000000 | ((r << 3 | r >> 2) << 16) |
+		((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+}
+
+// BC1 block is two RGB565 colors followed by 2-bit index of every texel.
+// Two more colors lie between them, unless first one isn't greater,
+// then there is middle one and transparent black
+static void block_colors(Uint8 *b, Uint32 *p) {
+	Uint32 c0 = b[0] | b[1] << 8, c1 = b[2] | b[3] << 8;
+	int i;
+
+	p[2] = p[3] = 0;
+	p[0] = unpack565(c0);
+	p[1] = unpack565(c1);
+	for(i = 0; i < 3; i++) { // per channel
+		int s = i*8;
+		int x = (p[0] >> s) & 0xff, y = (p[1] >> s) & 0xff;
+		if(c0 > c1) {
+			p[2] = (p[2] & ~(0xff << s)) | ((2*x + y)/3 << s);
+			p[3] = (p[3] & ~(0xff << s)) | ((x + 2*y)/3 << s);
+		} else {
+			p[2] = (p[2] & ~(0xff << s)) | ((x + y)/2 << s);
+		}
+	}
+	p[2] |= 0xff000000;
+	p[3] = c0 > c1 ? p[3] | 0xff000000 : 0;
+}
+
+static Uint32 *decode_block(Uint8 *b) {
+	int i, slot = ((size_t)b >> 3) & (BLOCK_CACHE-1);
+	Uint32 *t = cached_texels[slot];
+	if(cached_blocks[slot] == b) return t;
+
+	Uint32 bits = b[4] | b[5] << 8 | b[6] << 16 | b[7] << 24;
+	Uint32 p[4];
+	block_colors(b, p);
+	for(i = 0; i < 16; i++, bits >>= 2) t[i] = p[bits & 3];
+	cached_blocks[slot] = b;
+	return t;
+}
+
+// decode texels of BC1 texture for 'n' pixels of span, stepping 'uv'
+// by 'delta' in the same fixed point, as span kernel does
+static void fetch_texels(Uint16 *uv, Uint16 *delta, int n) {
+	Uint16 u = uv[0], v = uv[1];
+	int wm = texture->w-1, hm = texture->h-1, i;
+	Uint8 *pixels = texture->pixels;
+
+	assert(n <= MAX_SPAN);
+	// new blocks can take place of cached ones, and each thread has cache
+	// of its own, so they are checked here, rather than cleared
+	if(cached_generation != texture_generation) {
+		memset(cached_blocks, 0, sizeof(cached_blocks));
+		cached_generation = texture_generation;
+	}
+	for(i = 0; i < n; i++, u += delta[0], v += delta[1]) {
+		int x = (u*wm >> 16) & wm;
+		int y = (v*hm >> 16) & hm;
+		Uint8 *b = pixels + (y >> 2)*4*texture->pitch + (x >> 2)*8;
+		span_texels[i] = decode_block(b)[(y & 3)*4 + (x & 3)];
+	}
+}
+
 
 
 static void draw_span(lerp *l, int y, int x, int end_x) {
@@ -309,9 +822,6 @@ static void draw_span(lerp *l, int y, int x, int end_x) {
 #define fix(x) ((fixcol)(signed short)((x)*0xffff))
 #define unfix(x) ((float)(x)/(0xffff))
 
-	int tt[640];
-	memset(tt, 0, 4*640);
-
 	// color layout: AAAA|RRRR|GGGG|BBBB
 
 	Uint16 mm0[4];
@@ -335,32 +845,57 @@ static void draw_span(lerp *l, int y, int x, int end_x) {
 	// uv layout: 0000|0000|VVVV|UUUU
 	Uint16 mm6[4], uv_delta[4], uv_wh[4], uv_bp[4];
 
-	mm6[0] = fix(U(l));
-	mm6[1] = fix(V(l));
-	mm6[2] = 0;
-	mm6[3] = 0;
-
-	uv_delta[0] = fix(UD(l));
-	uv_delta[1] = fix(VD(l));
-	uv_delta[2] = 0;
-	uv_delta[3] = 0;
-
-	uv_wh[0] = texture->w-1;
-	uv_wh[1] = texture->h-1;
-	uv_wh[2] = 0;
-	uv_wh[3] = 0;
+	memset(mm6, 0, sizeof(mm6));
+	memset(uv_delta, 0, sizeof(uv_delta));
+	if(varyings & VARYING_UV) {
+		mm6[0] = fix(U(l));
+		mm6[1] = fix(V(l));
+		uv_delta[0] = fix(UD(l));
+		uv_delta[1] = fix(VD(l));
+	}
 
-	uv_bp[0] = texture->format->BytesPerPixel;
-	uv_bp[1] = texture->pitch;
-	uv_bp[2] = 0;
-	uv_bp[3] = 0;
+	// without texture 'uv' is left zero and kernel never samples
+	Uint8 *texels = 0;
+	Uint32 *palette = 0;
+	memset(uv_wh, 0, sizeof(uv_wh));
+	memset(uv_bp, 0, sizeof(uv_bp));
+	if(span_flags & SPAN_TEXTURE) {
+		texels = texture->pixels;
+		uv_wh[0] = texture->w-1;
+		uv_wh[1] = texture->h-1;
+		uv_bp[0] = texture->format->BytesPerPixel;
+		uv_bp[1] = texture->pitch;
+	}
+	if(span_flags & SPAN_PAL8) {
+		palette = (Uint32*)texture->format->palette->colors;
+	}
 
 	fixcol one[4] = {0xffff, 0xffff, 0xffff, 0xffff};
 	float z = Z(l);
 	float zd = ZD(l);
 
-	Uint8 *dst = (Uint8*)screen->pixels + y*screen->pitch +
-		x*screen->format->BytesPerPixel;
+	int pixel_size = screen->format->BytesPerPixel;
+	int depth_size = depth_bits == 16 ? 2 : 4;
+	Uint8 *dst = (Uint8*)screen->pixels + y*screen->pitch + x*pixel_size;
+	Uint8 *dst_end = dst + (end_x-x)*pixel_size;
+	Uint8 *depth = (Uint8*)zbuffer + (y*screen->w + x)*depth_size;
+	if(tiled) { // kernel steps to next tile after every 8 pixels
+		dst = tiles + TILE_OFFSET(x, y)*pixel_size;
+		dst_end = tiles + TILE_OFFSET(end_x, y)*pixel_size;
+		depth = (Uint8*)zbuffer + TILE_OFFSET(x, y)*depth_size;
+	}
+
+	// fixed point depth is 1/z as fraction of its value at near plane
+	float depth_max = depth_bits == 24 ? 16777215 : 65535;
+	float depth_scale = depth_max*near_clip;
+	Uint16 *dither = dither_matrix[y & 3][0];
+
+	// kernel reads texel for pixel at EDI from ESI+EDI, or ESI+EDI*2
+	// for 16-bit pixels
+	if(span_flags & SPAN_TEXELS) {
+		fetch_texels(mm6, uv_delta, end_x-x);
+		texels = (Uint8*)span_texels - (size_t)dst*(4/pixel_size);
+	}
 
 	// now we have following arrangements:
 	// EAX is temporary
@@ -381,15 +916,16 @@ static void draw_span(lerp *l, int y, int x, int end_x) {
 	// XMM7 holds Z Delta
 	// others are unsed
 	// MMX code assumes that botch: screen and textrue are in BGRA format
+	// (or screen is RGB565, when SPAN_RGB565 is set)
 	asm (
-		"movq %0,%%mm0\n\t"
-		"movq %1,%%mm1\n\t"
-		"movq %2,%%mm2\n\t"
-		"movq %3,%%mm6\n\t"
+		"movq %1,%%mm0\n\t"
+		"movq %2,%%mm1\n\t"
+		"movq %3,%%mm2\n\t"
+		"movq %4,%%mm6\n\t"
 		"pxor %%mm7,%%mm7\n\t"		// mm7 = 0
 
-		"movss %8,%%xmm6\n\t"		// z
-		"movss %9,%%xmm7\n\t"		// zd
+		"movss %9,%%xmm6\n\t"		// z
+		"movss %10,%%xmm7\n\t"		// zd
 
 		"jmp loop_start\n\t"
 
@@ -398,22 +934,106 @@ static void draw_span(lerp *l, int y, int x, int end_x) {
 		// Z-BUFFER TEST
 		"test $1, %%ecx\n\t"
 		"jz skip_ztest\n\t"
+		"test $" STR(SPAN_DEPTH16|SPAN_DEPTH24) ", %%ecx\n\t"
+		"jnz ztest_fixed\n\t"
 		"movss (%%ebx), %%xmm5\n\t"
+		"test $" STR(SPAN_ZEQUAL) ", %%ecx\n\t"
+		"jnz ztest_equal\n\t"
 		"cmpss $2, %%xmm6, %%xmm5\n\t" // xmm5 <= xmm6
 		"movd %%xmm5, %%eax\n\t"
 		"test %%eax, %%eax\n\t"
 		"jz loop_advance\n\t"
+		"test $" STR(SPAN_ZKEEP) ", %%ecx\n\t"
+		"jnz skip_ztest\n\t"
 		"movss %%xmm6, (%%ebx)\n\t" // save new z-value of this pixel
+		"jmp skip_ztest\n\t"
+		"ztest_equal:\n\t"			// depth is final, so it isn't saved
+		"cmpss $0, %%xmm6, %%xmm5\n\t" // xmm5 == xmm6
+		"movd %%xmm5, %%eax\n\t"
+		"test %%eax, %%eax\n\t"
+		"jz loop_advance\n\t"
+		"jmp skip_ztest\n\t"
+		"ztest_fixed:\n\t"
+		"movss %%xmm6, %%xmm5\n\t"
+		"mulss %14, %%xmm5\n\t"
+		"minss %15, %%xmm5\n\t"
+		"cvttss2si %%xmm5, %%eax\n\t"	// eax = z in 16 or 24 bits
+		"test $" STR(SPAN_DEPTH24) ", %%ecx\n\t"
+		"jnz ztest24\n\t"
+		"test $" STR(SPAN_ZEQUAL) ", %%ecx\n\t"
+		"jnz ztest16_equal\n\t"
+		"cmpw (%%ebx), %%ax\n\t"
+		"jb loop_advance\n\t"			// jmp if ax < depth
+		"test $" STR(SPAN_ZKEEP) ", %%ecx\n\t"
+		"jnz skip_ztest\n\t"
+		"movw %%ax, (%%ebx)\n\t"
+		"jmp skip_ztest\n\t"
+		"ztest16_equal:\n\t"
+		"cmpw (%%ebx), %%ax\n\t"
+		"jne loop_advance\n\t"
+		"jmp skip_ztest\n\t"
+		// 24-bit depth is in top bytes, so spare ones in low byte
+		// never decide test
+		"ztest24:\n\t"
+		"shl $8, %%eax\n\t"
+		"or $0xff, %%eax\n\t"
+		"test $" STR(SPAN_ZEQUAL) ", %%ecx\n\t"
+		"jnz ztest24_equal\n\t"
+		"cmp (%%ebx), %%eax\n\t"
+		"jb loop_advance\n\t"
+		"test $" STR(SPAN_ZKEEP) ", %%ecx\n\t"
+		"jnz skip_ztest\n\t"
+		"shr $8, %%eax\n\t"			// store top bytes only
+		"movw %%ax, 1(%%ebx)\n\t"
+		"shr $16, %%eax\n\t"
+		"movb %%al, 3(%%ebx)\n\t"
+		"jmp skip_ztest\n\t"
+		"ztest24_equal:\n\t"
+		"xor (%%ebx), %%eax\n\t"
+		"cmp $0xff, %%eax\n\t"
+		"ja loop_advance\n\t"
 		"skip_ztest:\n\t"
+		"test $" STR(SPAN_COUNT) ", %%ecx\n\t"
+		"jz skip_count\n\t"
+		"incl %0\n\t"					// one more pixel for query
+		"skip_count:\n\t"
+		"test $" STR(SPAN_NOCOLOR) ", %%ecx\n\t"
+		"jnz loop_advance\n\t"
 
 		// TEXTURE MAPPING (mm3 holds result)
+		"test $" STR(SPAN_TEXTURE) ", %%ecx\n\t"
+		"jnz do_texture\n\t"
+		"movq %7,%%mm3\n\t"				// mm3 = 1
+		"psrlw $8,%%mm3\n\t"			// mm3 = white texel
+		"jmp skip_texture\n\t"
+		"do_texture:\n\t"
+		"test $" STR(SPAN_TEXELS) ", %%ecx\n\t"
+		"jz sample_texture\n\t"
+		"test $" STR(SPAN_RGB565) ", %%ecx\n\t"
+		"jnz texel16\n\t"
+		"movd (%%esi,%%edi),%%mm3\n\t"	// mm3 = decoded texel
+		"jmp unpack_texel\n\t"
+		"texel16:\n\t"
+		"movd (%%esi,%%edi,2),%%mm3\n\t"
+		"jmp unpack_texel\n\t"
+		"sample_texture:\n\t"
 		"movq %%mm6,%%mm3\n\t"			// mm3 = uv
-		"pmulhuw %5,%%mm3\n\t"			// mm3 = u*w, v*h
-		"pand %5,%%mm3\n\t"				// mm3 = (u*w)%w,(u*h)%h : wrap
-		"pmaddwd %7,%%mm3\n\t"			// mm3 = linesz*vh+colorsz*uw
+		"pmulhuw %6,%%mm3\n\t"			// mm3 = u*w, v*h
+		"pand %6,%%mm3\n\t"				// mm3 = (u*w)%w,(u*h)%h : wrap
+		"pmaddwd %8,%%mm3\n\t"			// mm3 = linesz*vh+colorsz*uw
 		"movd %%mm3,%%eax\n\t"
+		"test $" STR(SPAN_PAL8) ", %%ecx\n\t"
+		"jnz sample_palette\n\t"
 		"movd (%%eax,%%esi),%%mm3\n\t"	// mm3 = packed_texture
+		"jmp unpack_texel\n\t"
+		"sample_palette:\n\t"
+		"movzbl (%%eax,%%esi),%%eax\n\t"	// eax = index
+		"shl $2,%%eax\n\t"
+		"add %11,%%eax\n\t"
+		"movd (%%eax),%%mm3\n\t"		// mm3 = packed palette entry
+		"unpack_texel:\n\t"
 		"punpcklbw %%mm7,%%mm3\n\t"		// mm3 = texture
+		"skip_texture:\n\t"
 
 		// LIGHTS (mm3 holds result)
 		"test $2, %%ecx\n\t"
@@ -430,25 +1050,82 @@ static void draw_span(lerp *l, int y, int x, int end_x) {
 		"pshufw $0xff,%%mm3,%%mm4\n\t"	// mm4 = src_alpha
 		"psllw $8,%%mm4\n\t"			// convert mm4 to fixed point
 		"pmulhuw %%mm4,%%mm3\n\t"		// mm3 = src*src_alpha
-		"movq %6,%%mm5\n\t"				// mm5 = 1
+		"movq %7,%%mm5\n\t"				// mm5 = 1
 		"psubw %%mm4,%%mm5\n\t"			// mm5 = 1-src_alpha
+		"test $" STR(SPAN_RGB565) ", %%ecx\n\t"
+		"jnz blend565\n\t"
 		"movd (%%edi),%%mm4\n\t"		// mm4 = dst_packed
 		"punpcklbw %%mm7,%%mm4\n\t"		// mm4 = dst
+		"jmp blend_dst\n\t"
+		"blend565:\n\t"
+		"movzwl (%%edi),%%eax\n\t"
+		"movd %%eax,%%mm4\n\t"
+		"pshufw $0,%%mm4,%%mm4\n\t"		// mm4 = dst_packed in every word
+		"pmullw %17,%%mm4\n\t"			// move blue to top bits
+		"pand %18,%%mm4\n\t"				// channels in top bits
+		"pmulhuw %19,%%mm4\n\t"			// mm4 = dst
+		"blend_dst:\n\t"
 		"pmulhuw %%mm5,%%mm4\n\t"		// mm4 = dst*(1-src_alpha)
 		"paddw %%mm4,%%mm3\n\t"			// mm3 = src*src_alpha + dst*(1-src_alpha)
 		"skip_blending:\n\t"
 
 		// ENDING
+		"test $" STR(SPAN_RGB565) ", %%ecx\n\t"
+		"jnz pack565\n\t"
 		"packuswb %%mm7,%%mm3\n\t"		// pack pixel in mm3...
 		"movd %%mm3,(%%edi)\n\t"		// and puti it to final resting place
+		"jmp loop_advance\n\t"
+		"pack565:\n\t"
+		"test $" STR(SPAN_DITHER) ", %%ecx\n\t"
+		"jz skip_dither\n\t"
+		"mov %%edi,%%eax\n\t"
+		"and $6,%%eax\n\t"
+		"shl $2,%%eax\n\t"
+		"add %16,%%eax\n\t"				// eax = thresholds of column
+		"paddusw (%%eax),%%mm3\n\t"
+		"skip_dither:\n\t"
+		"packuswb %%mm7,%%mm3\n\t"		// clamp to 8 bits
+		"punpcklbw %%mm7,%%mm3\n\t"
+		"pand %20,%%mm3\n\t"				// keep bits, which fit
+		"pmaddwd %21,%%mm3\n\t"			// mm3 = g:b, r in place << 3
+		"movq %%mm3,%%mm4\n\t"
+		"psrlq $32,%%mm4\n\t"
+		"por %%mm4,%%mm3\n\t"
+		"psrld $3,%%mm3\n\t"
+		"movd %%mm3,%%eax\n\t"
+		"movw %%ax,(%%edi)\n\t"
 
 		// ADVANCE
 		"loop_advance:\n\t"
 		"paddw %%mm1,%%mm0\n\t"			// advance light
-		"paddw %4,%%mm6\n\t" 			// advance uv
+		"paddw %5,%%mm6\n\t" 			// advance uv
 		"addss %%xmm7,%%xmm6\n\t"		// advance z
-		"add $4,%%edi\n\t"				// advance x
-		"add $4,%%ebx\n\t"
+		"add %12,%%edi\n\t"				// advance x
+		"add %13,%%ebx\n\t"
+
+		// tile rows are 8 pixels, so EDI at multiple of 8 pixels has
+		// left row and goes to same row in next tile, 56 pixels ahead
+		"test $" STR(SPAN_TILED) ", %%ecx\n\t"
+		"jz loop_start\n\t"
+		"test $" STR(SPAN_RGB565) ", %%ecx\n\t"
+		"jnz tile16\n\t"
+		"test $31,%%edi\n\t"
+		"jnz loop_start\n\t"
+		"add $224,%%edi\n\t"
+		"jmp tile_depth\n\t"
+		"tile16:\n\t"
+		"test $15,%%edi\n\t"
+		"jnz loop_start\n\t"
+		"add $112,%%edi\n\t"
+		"tile_depth:\n\t"
+		"add $112,%%ebx\n\t"
+		"test $" STR(SPAN_DEPTH16) ", %%ecx\n\t"
+		"jnz tile_texels\n\t"
+		"add $112,%%ebx\n\t"
+		"tile_texels:\n\t"				// texels stay at ESI+EDI*4/pixel_size
+		"test $" STR(SPAN_TEXELS) ", %%ecx\n\t"
+		"jz loop_start\n\t"
+		"sub $224,%%esi\n\t"
 
 		// LOOP CONTROL
 		"loop_start:\n\t"
@@ -457,19 +1134,33 @@ static void draw_span(lerp *l, int y, int x, int end_x) {
 
 		"emms\n\t"						// reset FPU after MMX
 		:
+		"+m" (query_pixels)	// 0
 		:
-		"m" (*mm0),			// 0
-		"m" (*mm1),			// 1
-		"m" (*mm2),			// 2
-		"m" (*mm6),			// 3
-		"m" (*uv_delta),	// 4
-		"m" (*uv_wh),		// 5
-		"m" (*one),			// 6
-		"m" (*uv_bp),		// 7
-		"m" (z),			// 8
-		"m" (zd),			// 9
-		"c" (flags),		// ecx
-		"b" (zbuffer+y*screen->w+x), "d" (dst+(end_x-x)*4),  "D" (dst), "S" (texture->pixels)
+		"m" (*mm0),			// 1
+		"m" (*mm1),			// 2
+		"m" (*mm2),			// 3
+		"m" (*mm6),			// 4
+		"m" (*uv_delta),	// 5
+		"m" (*uv_wh),		// 6
+		"m" (*one),			// 7
+		"m" (*uv_bp),		// 8
+		"m" (z),			// 9
+		"m" (zd),			// 10
+		"m" (palette),		// 11
+		"m" (pixel_size),	// 12
+		"m" (depth_size),	// 13
+		"m" (depth_scale),	// 14
+		"m" (depth_max),	// 15
+		"m" (dither),		// 16
+		"m" (*unpack_mul),	// 17
+		"m" (*unpack_mask),	// 18
+		"m" (*unpack_scale),// 19
+		"m" (*pack_mask),	// 20
+		"m" (*pack_mul),	// 21
+		"c" (span_flags),	// ecx
+		"b" (depth), "d" (dst_end),  "D" (dst), "S" (texels)
+		:
+		"eax", "memory"
 	);
 }
 
@@ -580,41 +1271,211 @@ static void draw_span(lerp *l, int y, int x, int end_x) {
 		}
 		int i;
 		// advance
-		for(i = 0; i < IPLS-2; ++i) l->i[i] += l->s[i];
+		for(i = 0; i < nipls; ++i) l->i[i] += l->s[i];
 		p += screen->format->BytesPerPixel;
 	}
 }
 #endif
 
-static void draw_face3(int y, lerp *a, lerp *b, Face *f) {
+// number of steps from 'x' to the pixel, where next perspective divide
+// is done. It is the start of next run, or the last pixel, so that
+// interpolants are always taken inside the triangle
+static int run_steps(int x, int end_x) {
+	if(run_length && end_x - x > run_length) return run_length;
+	return end_x - x - 1;
+}
+
+static void draw_face3(int y, int x, int end_x, plane *p) {
 	// scanline level
-	if(X(a) > X(b)) {
-		lerp *t = a;
-		a = b;
-		b = t;
+	float s[LERP_IPLS], e[LERP_IPLS];	// 1/z-premultiplied values
+	float ts[LERP_IPLS], te[LERP_IPLS];	// true values
+	float ze;
+	int i, n, n2;
+	lerp l;
+
+	stats.pixels += end_x - x;
+
+	// 1/z is always interpolated, so index 0 is done outside the loops
+	s[0] = p->row.i[0] + p->dx[0]*x;
+	for(i = 1; i < nipls; ++i) s[i] = p->row.i[i] + p->dx[i]*x;
+	unproject(s, ts, 1/s[0]);
+
+	n = run_steps(x, end_x);
+	e[0] = s[0] + p->dx[0]*n;
+	for(i = 1; i < nipls; ++i) e[i] = s[i] + p->dx[i]*n;
+	unproject(e, te, 1/e[0]);
+
+	// span is drawn in runs with affine stepping, and perspective is
+	// restored at their ends only
+	while(x < end_x) {
+		int x2 = x + MIN(run_length ? run_length : end_x, end_x - x);
+
+		lerp_init_x(&l, ts, te, n);
+		ZD(&l) = p->dx[0]; // 1/z is linear on screen
+
+		// NOTE: divide for the end of next run is issued before drawing
+		// this one, so that it is done while span kernel is running
+		n2 = 0;
+		ze = 1;
+		if(x2 < end_x) {
+			n2 = run_steps(x2, end_x);
+			s[0] = e[0] + p->dx[0]*n2;
+			for(i = 1; i < nipls; ++i) s[i] = e[i] + p->dx[i]*n2;
+			ze = 1/s[0];
+		}
+
+		draw_span(&l, y, x, x2);
+
+		memcpy(ts, te, sizeof(te));
+		memcpy(e, s, sizeof(s));
+		unproject(e, te, ze);
+		x = x2;
+		n = n2;
 	}
+}
 
-	int x = (int)X(a);
-	int end_x = (int)X(b);
+static void *grow(void *p, int *max, int n, int size);
+
+static int sbuffer_span(int x0, int x1, int face, float z, float dz, int next) {
+	sbuffer = grow(sbuffer, &max_sbuffer, total_sbuffer+1, sizeof(SBufferSpan));
+	SBufferSpan *s = &sbuffer[total_sbuffer];
+	s->x0 = x0;
+	s->x1 = x1;
+	s->face = face;
+	s->z = z;
+	s->dz = dz;
+	s->next = next;
+	return total_sbuffer++;
+}
 
-	if(x >= end_x) return;
-	lerp l;
-	if(x < 0) {
-		lerp_init_x(&l, a, b, -x, end_x - x);
-		x = 0;
-	} else lerp_init_x(&l, a, b, 0, end_x - x);
+// cut span 'i' at pixel 'x', returns its right part
+static int sbuffer_split(int i, int x) {
+	SBufferSpan s = sbuffer[i];
+	int j = sbuffer_span(x, s.x1, s.face, s.z, s.dz, s.next);
+	sbuffer[i].x1 = x;
+	sbuffer[i].next = j;
+	return j;
+}
 
-	if(end_x > screen->w) end_x = screen->w;
+// link to span after 'prev' or to first span of scanline, if it's -1
+// NOTE: it's taken again after every new span, as they move sbuffer
+#define SBUFFER_LINK(prev) (*((prev) < 0 ? &sbuffer_rows[y] : &sbuffer[prev].next))
+
+// put scanline of 'sbuffer_face' into span buffer, where it is in front
+static void sbuffer_insert(int y, int x, int end_x, plane *p) {
+	float z = p->row.i[0], dz = p->dx[0];
+	int prev = -1, i, j;
+
+	stats.pixels += end_x - x;
 
-	draw_span(&l, y, x, end_x);
-	/*#define STEP 64
 	while(x < end_x) {
-		draw_span(&l, y, x, x+MIN(end_x-x, STEP));
-		x += STEP;
-	}*/
+		i = SBUFFER_LINK(prev);
+		if(i >= 0 && sbuffer[i].x1 <= x) { // span is on the left
+			prev = i;
+			continue;
+		}
+		if(i < 0 || sbuffer[i].x0 >= end_x) { // rest is uncovered
+			j = sbuffer_span(x, end_x, sbuffer_face, z, dz, i);
+			SBUFFER_LINK(prev) = j;
+			return;
+		}
+		if(sbuffer[i].x0 > x) { // gap before span
+			j = sbuffer_span(x, sbuffer[i].x0, sbuffer_face, z, dz, i);
+			SBUFFER_LINK(prev) = j;
+			prev = j;
+			x = sbuffer[i].x0;
+			continue;
+		}
+
+		// span covers [x, e), face is in front, where its 1/z isn't less,
+		// as with z-test. Planes cross at most once, so it is in front
+		// either at the start or at the end of overlap
+		SBufferSpan *s = &sbuffer[i];
+		int e = MIN(end_x, s->x1), a = x, b = x;
+#define FRONT(px) (z + dz*(px) >= s->z + s->dz*(px))
+		int f0 = FRONT(x), f1 = FRONT(e-1);
+		if(f0 && f1) {
+			b = e;
+		} else if(f0 || f1) {
+			// first pixel past crossing, estimate is rounded, so it
+			// is moved onto pixel, where order really changes
+			float d0 = z - s->z + (dz - s->dz)*x;
+			float d1 = z - s->z + (dz - s->dz)*(e-1);
+			int c = x + 1 + (int)(d0/(d0 - d1)*(e-1 - x));
+			c = MAX(x+1, MIN(c, e-1));
+			while(c > x+1 && FRONT(c-1) != f0) c--;
+			while(c < e-1 && FRONT(c) == f0) c++;
+			if(f0) b = c;
+			else a = c, b = e;
+		}
+#undef FRONT
+
+		if(a < b) {
+			if(a > s->x0) i = sbuffer_split(i, a);
+			if(b < sbuffer[i].x1) sbuffer_split(i, b);
+			s = &sbuffer[i];
+			s->face = sbuffer_face;
+			s->z = z;
+			s->dz = dz;
+		}
+		// spans up to 'e' get skipped from 'prev' on
+		x = e;
+	}
+}
+
+#undef SBUFFER_LINK
+
+// draw parts of scanline, where 'sbuffer_face' is visible
+static void sbuffer_shade(int y, int x, int end_x, plane *p) {
+	int i;
+	for(i = sbuffer_rows[y]; i >= 0 && sbuffer[i].x0 < end_x; i = sbuffer[i].next) {
+		SBufferSpan *s = &sbuffer[i];
+		if(s->face == sbuffer_face && s->x1 > x)
+			draw_face3(y, MAX(x, s->x0), MIN(end_x, s->x1), p);
+	}
+}
+
+static void draw_scanline(int y, int x, int end_x, plane *p) {
+	switch(sbuffer_pass) {
+	case SBUFFER_INSERT: sbuffer_insert(y, x, end_x, p); break;
+	case SBUFFER_SHADE: sbuffer_shade(y, x, end_x, p); break;
+	default: draw_face3(y, x, end_x, p);
+	}
+}
+
+
+
+// time of clipping, triangle setup and spans is summed over batch, as
+// events of every face would flood trace, and written as events laid one
+// after other from start of batch
+#define STAGE_CLIP			0
+#define STAGE_SETUP			1
+#define STAGE_RASTER		2
+#define STAGES				3
+
+static __thread Uint64 stage_times[STAGES];
+
+// add time since 't' to 'stage', 't' becomes now
+static void stage_lap(int stage, Uint64 *t) {
+	Uint64 now = trace_time();
+	stage_times[stage] += now - *t;
+	*t = now;
 }
 
+#define STAGE_START(t) Uint64 t = trace_on ? trace_time() : 0
+#define STAGE_LAP(stage, t) do { if(trace_on) stage_lap(stage, &(t)); } while(0)
+
+static void trace_stages(Uint64 start) {
+	static char *names[STAGES] = {"clip", "setup", "raster"};
+	int i;
 
+	if(!trace_on) return;
+	for(i = 0; i < STAGES; i++) {
+		if(stage_times[i]) trace_complete(names[i], start, stage_times[i]);
+		start += stage_times[i];
+		stage_times[i] = 0;
+	}
+}
 
 // project vertex onto center of screen surface
 void project_vertex(Vertex *p, Vertex *q) {
@@ -626,214 +1487,278 @@ void project_vertex(Vertex *p, Vertex *q) {
 	// NOTE: we should write '-y', because in SDL's image-buffer origin is top-left
 	// corner, not bottom-right (as in euclidian space).
 
-	for(i = 0; i < IPLS-3; ++i) q->i[i] = p->i[i];
-
 	// dividing by 'z' is nescecary for perspective correction
-	for(i = 0; i < IPLS-3; ++i) q->i[i] *= Z(q);
+	// NOTE: only varyings in use are carried, normals are done with
+	// after lighting
+	for(i = 1; i < nipls; ++i) q->i[i] = p->i[i]*Z(q);
 }
 
-static void draw_face2(Vertex *p, Vertex *q, Vertex *r, Face *f) {
+// snap projected vertex position to sub-pixel grid
+static int snap_vertex(Vertex *v) {
+	if(MODULE(X(v)) > GUARD_BAND || MODULE(Y(v)) > GUARD_BAND) return 0;
+	X(v) = floorf(X(v)*SUBPIXEL + 0.5f)/SUBPIXEL;
+	Y(v) = floorf(Y(v)*SUBPIXEL + 0.5f)/SUBPIXEL;
+	return 1;
+}
+
+static void draw_face2(Vertex *p, Vertex *q, Vertex *r) {
 	// 2-d triangle level
 
 	// create local projected copies
-	Vertex r1, r2, r3, *a = &r1, *b = &r2, *c = &r3;
+	Vertex r1, r2, r3, *a = &r1, *b = &r2, *c = &r3, *t;
+	STAGE_START(time);
 	project_vertex(p, a);
 	project_vertex(q, b);
 	project_vertex(r, c);
 
 	// make sure this triangle has on screen parts
-	if(X(a) < 0 && X(b) < 0 && X(c) < 0) return;
-	if(X(a) >= screen->w && X(b) >= screen->w && X(c) >= screen->w) return;
-
-	// we wont draw, if it's very thin at y axis
-	if((int)X(a) == (int)X(b) && (int)X(a) == (int)X(c)) return;
-
-	// sort by 'y' (should be done in float)
-	if(Y(a) > Y(b)) {
-		Vertex *t = a;
-		a = b;
-		b = t;
+	if((X(a) < 0 && X(b) < 0 && X(c) < 0) ||
+	   (X(a) >= screen->w && X(b) >= screen->w && X(c) >= screen->w) ||
+	   !snap_vertex(a) || !snap_vertex(b) || !snap_vertex(c)) {
+		STAGE_LAP(STAGE_SETUP, time);
+		return;
 	}
-	if(Y(a) > Y(c)) {
-		Vertex *t = a;
-		a = c;
-		c = t;
-	}
-	if(Y(b) > Y(c)) {
-		Vertex *t = b;
-		b = c;
-		c = t;
-	}
-
-	// we should always use integers for lead counters
-	int beg_y = Y(a);
-	int cen_y = Y(b);
-	int end_y = Y(c);
-	int y, e;
-
-	if(end_y == beg_y || end_y < 0 || beg_y >= screen->h) return;
 
-	lerp x1, x2;
-
-	if(beg_y < 0) {
-		lerp_init_y(&x2, a, c, -beg_y, end_y-beg_y);
-		y = 0;
-	} else {
-		lerp_init_y(&x2, a, c, 0, end_y-beg_y);
-		y = beg_y;
+	// sort by 'y'
+	if(Y(a) > Y(b)) t = a, a = b, b = t;
+	if(Y(a) > Y(c)) t = a, a = c, c = t;
+	if(Y(b) > Y(c)) t = b, b = c, c = t;
+
+	// NOTE: all values below are exact, as snapped positions
+	// are representable in floats
+	int xa = X(a)*SUBPIXEL, ya = Y(a)*SUBPIXEL;
+	int xb = X(b)*SUBPIXEL, yb = Y(b)*SUBPIXEL;
+	int xc = X(c)*SUBPIXEL, yc = Y(c)*SUBPIXEL;
+
+	long long area = (long long)(xb-xa)*(yc-ya) - (long long)(xc-xa)*(yb-ya);
+	if(!area) {
+		STAGE_LAP(STAGE_SETUP, time);
+		return;
 	}
 
-	if(y < cen_y) {
-		if(beg_y < 0) lerp_init_y(&x1, a, b, -beg_y, cen_y-beg_y);
-		else lerp_init_y(&x1, a, b, 0, cen_y-beg_y);
+	// scanlines are drawn if their pixel centers are in [top, bottom)
+	int beg_y = ceil_div(ya - SUBPIXEL/2, SUBPIXEL);
+	int cen_y = ceil_div(yb - SUBPIXEL/2, SUBPIXEL);
+	int end_y = ceil_div(yc - SUBPIXEL/2, SUBPIXEL);
+	int y = MAX(beg_y, 0), e;
 
-		if(cen_y > screen->h) e = screen->h;
-		else e = cen_y;
+	if(end_y <= 0 || beg_y >= screen->h || beg_y == end_y) {
+		STAGE_LAP(STAGE_SETUP, time);
+		return;
+	}
 
-		for(; y < e; ++y) {
-			draw_face3(y, &x1, &x2, f);
-			lerp_advance_y(&x1);
-			lerp_advance_y(&x2);
+	plane pl;
+	plane_init(&pl, a, b, c, (float)area/(SUBPIXEL*SUBPIXEL), y);
+
+	// long edge (a,c) is on the left, if 'b' is on the right of it
+	edge e1, e2, *left, *right;
+	edge_init(&e1, xa, ya, xc, yc, y);
+	if(area > 0) left = &e1, right = &e2;
+	else left = &e2, right = &e1;
+
+	// pixels are drawn if their centers are in [left, right)
+#define DRAW_SCANLINES(e)											\
+		for(; y < (e); ++y) {										\
+			int x = MAX(left->x, 0);								\
+			int end_x = MIN(right->x, screen->w);					\
+			if(x < end_x) {											\
+				STAGE_LAP(STAGE_SETUP, time);						\
+				draw_scanline(y, x, end_x, &pl);					\
+				STAGE_LAP(STAGE_RASTER, time);						\
+			}														\
+			edge_advance(&e1);										\
+			edge_advance(&e2);										\
+			lerp_advance_y(&pl.row);								\
 		}
-	}
 
-	if(cen_y < end_y) {
-		lerp_init_y(&x1, b, c, y-cen_y, end_y-cen_y);
-		if(end_y > screen->h) end_y = screen->h;
+	if(y < cen_y) {
+		edge_init(&e2, xa, ya, xb, yb, y);
+		e = MIN(cen_y, screen->h);
+		DRAW_SCANLINES(e);
+	}
 
-		for(; y < end_y; ++y) {
-			draw_face3(y, &x1, &x2, f);
-			lerp_advance_y(&x1);
-			lerp_advance_y(&x2);
-		}
+	if(y < screen->h && cen_y < end_y) {
+		edge_init(&e2, xb, yb, xc, yc, y);
+		e = MIN(end_y, screen->h);
+		DRAW_SCANLINES(e);
 	}
+#undef DRAW_SCANLINES
 
-	ntriangles++;
+	stats.triangles++;
+	STAGE_LAP(STAGE_SETUP, time);
 }
 
-// calculate point of intersection between viewing plane and line (a,b)
-static void viewplane_clip(Vertex *a, Vertex *b, Vertex *r) {
-	float d, t;
-
-	d = Z(b) - Z(a);
-
-	// check, if vertices merge into single one
-	// this should not happen, though
-	//if(d == 0) d = 0.0000001;
-
-	t = (near_clip - Z(a))/d; // tangent
+// near plane and four planes, which keep projected vertices inside
+// guard band: |(w+h)*x/z| <= GUARD_BAND puts 'x' on screen within it
+#define CLIP_PLANES			5
+
+// distance of vertex from clip plane, inside is positive
+static float clip_distance(Vertex *v, int plane) {
+	float k = screen->w + screen->h;
+	switch(plane) {
+	case 0: return Z(v) - near_clip;
+	case 1: return GUARD_BAND*Z(v) - k*X(v);
+	case 2: return GUARD_BAND*Z(v) + k*X(v);
+	case 3: return GUARD_BAND*Z(v) - k*Y(v);
+	default: return GUARD_BAND*Z(v) + k*Y(v);
+	}
+}
 
+// calculate point 't' of the way along line (a,b)
+static void clip_edge(Vertex *a, Vertex *b, float t, Vertex *r) {
 	int i;
-	for(i = 0; i < IPLS; ++i)
+	for(i = 0; i < nipls; ++i)
 		r->i[i] = a->i[i] + (b->i[i]-a->i[i])*t;
+	X(r) = X(a) + (X(b)-X(a))*t;
+	Y(r) = Y(a) + (Y(b)-Y(a))*t;
 }
 
-
-
 static void draw_face(Face *f) {
 	// 3-d triangle level
 
 	// NOTE: we should never modify user nor provided Face
 	//       nor its vertices
-	Vertex *a = f->a;
-	Vertex *b = f->b;
-	Vertex *c = f->c;
-	Vertex *t, r1, r2;
-
-	// sort by 'z'
-	if(Z(a) > Z(c)) t = a, a = c, c = t;
-	if(Z(a) > Z(b)) t = a, a = b, b = t;
-	if(Z(b) > Z(c)) t = c, c = b, b = t;
-
-	if(Z(c) < near_clip) return; // fully clipped
-
-	// calculate lights for each vertex
-	if(Z(a) < near_clip) {
-		viewplane_clip(c, a, &r1);
-		if(Z(b) < near_clip) {
-			viewplane_clip(c, b, &r2);
-			a = &r1;
-			b = &r2;
-		} else {
-			viewplane_clip(b, a, &r2);
-			draw_face2(c, b, &r2, f);
-			a = &r1;
-			b = &r2;
+	// every plane cuts two edges of convex polygon, so it adds two
+	// vertices at most
+	Vertex clipped[2*CLIP_PLANES];
+	Vertex *in[3+2*CLIP_PLANES], *out[3+2*CLIP_PLANES];
+	float d[3+2*CLIP_PLANES];
+	int n = 3, used = 0, plane, inside, i, j, m;
+	STAGE_START(time);
+
+	in[0] = f->a;
+	in[1] = f->b;
+	in[2] = f->c;
+
+	// polygon is clipped by one plane after other, almost all faces are
+	// inside of all of them, and are drawn as they are
+	for(plane = 0; plane < CLIP_PLANES; plane++) {
+		for(i = inside = 0; i < n; i++)
+			inside += (d[i] = clip_distance(in[i], plane)) >= 0;
+		if(inside == n) continue;
+		if(!inside) { // fully clipped
+			STAGE_LAP(STAGE_CLIP, time);
+			return;
+		}
+
+		for(i = m = 0; i < n; i++) {
+			j = i+1 < n ? i+1 : 0;
+			if(d[i] >= 0) out[m++] = in[i];
+			if((d[i] >= 0) != (d[j] >= 0)) {
+				// rounding could make sliver look concave
+				if(used == 2*CLIP_PLANES) {
+					STAGE_LAP(STAGE_CLIP, time);
+					return;
+				}
+				clip_edge(in[i], in[j], d[i]/(d[i]-d[j]), clipped+used);
+				out[m++] = clipped + used++;
+			}
 		}
+		memcpy(in, out, m*sizeof(*in));
+		n = m;
 	}
 
-	draw_face2(c, b, a, f);
+	STAGE_LAP(STAGE_CLIP, time);
+	for(i = 2; i < n; i++) draw_face2(in[0], in[i-1], in[i]);
 }
 
 
-void D3D_Begin(int t) {
-	draw_type = t;
-	assert(0 < draw_type && draw_type <= D3D_QUAD_STRIP);
-	total_vertices = 0;
+// tells if face is turned to viewer. The triple product a.(b x c) has
+// sign of face area after projection (z is positive for visible parts),
+// but needs no division and works before near plane clipping
+static int is_front_face(Face *f) {
+	Vertex *a = f->a, *b = f->b, *c = f->c;
+	float d = X(a)*(Y(b)*Z(c) - Z(b)*Y(c))
+		+ Y(a)*(Z(b)*X(c) - X(b)*Z(c))
+		+ Z(a)*(X(b)*Y(c) - Y(b)*X(c));
+
+	// camera space has 'y' looking up, so d > 0 is counter-clockwise
+	return front_face == D3D_CCW ? d > 0 : d < 0;
 }
 
-void D3D_End() {
-	int i;
-	Vertex *v = vertex_buffer;
-	Face *f = face_buffer;
+// maps float to integer, which compares the same way (for radix sort)
+static Uint32 float_key(float f) {
+	union {float f; Uint32 i;} u;
+	u.f = f;
+	return (u.i & 0x80000000) ? ~u.i : u.i | 0x80000000;
+}
 
+// order first 'total_faces' faces front-to-back by their nearest vertex,
+// or back-to-front by farthest one. Sort is stable, taking 4 passes of
+// byte-sized LSD radix sort at most, so cost is linear in face count
+static void sort_faces(Face *faces, int total_faces, int back_to_front) {
+	SortedFace *src = sorted_faces[0], *dst = sorted_faces[1], *t;
+	int count[256];
+	int i, shift;
+
+	for(i = 0; i < total_faces; i++) {
+		Face *f = faces+i;
+		if(back_to_front) {
+			src[i].key = ~float_key(MAX(Z(f->a), MAX(Z(f->b), Z(f->c))));
+		} else {
+			src[i].key = float_key(MIN(Z(f->a), MIN(Z(f->b), Z(f->c))));
+		}
+		src[i].face = *f;
+	}
 
-	assert(total_vertices != 0);
-	if(total_vertices == 1) assert(draw_type == D3D_POINTS);
-	else if(total_vertices == 2) assert(draw_type == D3D_LINES);
+	for(shift = 0; shift < 32; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for(i = 0; i < total_faces; i++)
+			count[(src[i].key >> shift) & 0xff]++;
 
-	switch(draw_type) {
-	case D3D_POINTS:
-		// not implemented
-		break;
-	case D3D_LINES:
-		// not implemented
-		break;
-	case D3D_TRIANGLES:
-		total_vertices -= total_vertices % 3;
-		for(i = 0; i < total_vertices; i += 3, f++) {
-			f->a = v+i;
-			f->b = v+i+1;
-			f->c = v+i+2;
-		}
-		break;
-	case D3D_TRIANGLE_FAN: // every next connected to the first and previous
-		for(i = 2; i < total_vertices; i++, f++) {
-			f->a = v;
-			f->b = v+i-1;
-			f->c = v+i;
-		}
-		break;
-	case D3D_TRIANGLE_STRIP: // every one connected to two previous
-		for(i = 2; i < total_vertices; i++, f++) {
-			f->a = v+i;
-			f->b = v+i-1;
-			f->c = v+i-2;
-		}
-		break;
-	case D3D_QUADS:
-		total_vertices -= total_vertices % 4;
-		for(i = 0; i < total_vertices; i+=4) {
-			f->a = v+i;
-			f->b = v+i+1;
-			f->c = v+i+2;
-			f++;
-			f->a = v+i;
-			f->b = v+i+2;
-			f->c = v+i+3;
-			f++;
-		}
-		break;
-	case D3D_QUAD_STRIP: // every two connected to two previous
-		for(i = 2; i < total_vertices; i++, f++) {
-			f->a = v+i;
-			f->b = v+i-1;
-			f->c = v+i-2;
+		// all keys have same digit, nothing to move
+		if(count[(src[0].key >> shift) & 0xff] == total_faces)
+			continue;
+
+		int sum = 0;
+		for(i = 0; i < 256; i++) {
+			int c = count[i];
+			count[i] = sum;
+			sum += c;
 		}
-		break;
+		for(i = 0; i < total_faces; i++)
+			dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+		t = src;
+		src = dst;
+		dst = t;
+	}
+
+	for(i = 0; i < total_faces; i++)
+		faces[i] = src[i].face;
+}
+
+// normal of vertex, which looks away from center of mesh
+static void vertex_normal(Vertex *v, float cx, float cy, float cz) {
+	float x = X(v) - cx;
+	float y = Y(v) - cy;
+	float z = Z(v) - cz;
+	float m = sqrt(x*x + y*y + z*z);
+	NX(v) = x/m;
+	NY(v) = y/m;
+	NZ(v) = z/m;
+}
+
+// add diffuse light of 'l' at vertex, times 'k', to r, g, b of 'c'
+static void add_light(Vertex *v, Light *l, float k, float *c) {
+	float lx = l->x - X(v);
+	float ly = l->y - Y(v);
+	float lz = l->z - Z(v);
+	float m = sqrt(lx*lx+ly*ly+lz*lz);
+	lx /= m;
+	ly /= m;
+	lz /= m;
+	float d = NX(v)*lx + NY(v)*ly + NZ(v)*lz;
+	if(d>0) {
+		c[0] += k*d*l->r;
+		c[1] += k*d*l->g;
+		c[2] += k*d*l->b;
 	}
+}
 
-	int total_faces = f-face_buffer;
+// calculate lights for vertices used by first 'total_faces' faces
+static void light_vertices(int total_faces) {
+	Vertex *v = vertex_buffer;
+	int i;
 
 	// calculate center of mesh
 	float cx = 0, cy = 0, cz = 0;
@@ -846,83 +1771,1213 @@ void D3D_End() {
 	cy /= total_vertices;
 	cz /= total_vertices;
 
-	if(flags & D3D_LIGHTS) { // calculate lights
-		for(i = 0; i < total_vertices; i++) {
-			float x = X(v+i) - cx;
-			float y = Y(v+i) - cy;
-			float z = Z(v+i) - cz;
-			float m = sqrt(x*x + y*y + z*z);
-			NX(v+i) = x/m;
-			NY(v+i) = y/m;
-			NZ(v+i) = z/m;
-
-			// now we are ready to calculate light value for this vertex
-			int j;
-			for(j = 0; j < total_lights; ++j) {
-				Light *l = light_buffer+j;
-				float lx = l->x - X(v+i);
-				float ly = l->y - Y(v+i);
-				float lz = l->z - Z(v+i);
-				float m = sqrt(lx*lx+ly*ly+lz*lz);
-				lx /= m;
-				ly /= m;
-				lz /= m;
-				float d = NX(v+i)*lx + NY(v+i)*ly + NZ(v+i)*lz;
-				if(d>0) {
-					R(v+i) += d*l->r;
-					G(v+i) += d*l->g;
-					B(v+i) += d*l->b;
-				}
-			}
-		}
+	assert(0 <= total_vertices && total_vertices <= MAX_VERTICES);
+	memset(vertex_used, 0, (size_t)total_vertices*sizeof(*vertex_used));
+	for(i = 0; i < total_faces; i++) {
+		vertex_used[face_buffer[i].a - v] = 1;
+		vertex_used[face_buffer[i].b - v] = 1;
+		vertex_used[face_buffer[i].c - v] = 1;
 	}
 
-	f = face_buffer;
-
-	if(flags & D3D_CULLING) { // back-face culling
-		for(i = 0; i < total_faces; i++) {
-			// calculate direction vector perpendicular to this face
-			// NOTE: we should correct its perspective
-			float xa = X(f[i].c)/Z(f[i].c)-X(f[i].a)/Z(f[i].a);
-			float ya = Y(f[i].c)/Z(f[i].c)-Y(f[i].a)/Z(f[i].a);
-			float za = Z(f[i].c)-Z(f[i].a);
-			float xb = X(f[i].c)/Z(f[i].c)-X(f[i].b)/Z(f[i].b);
-			float yb = Y(f[i].c)/Z(f[i].c)-Y(f[i].b)/Z(f[i].b);
-			float zb = Z(f[i].c)-Z(f[i].b);
-			f[i].nx = ya*zb - za*yb;
-			f[i].ny = za*xb - xa*zb;
-			f[i].nz = xa*yb - ya*xb;
-			float m = sqrt(f[i].nx*f[i].nx + f[i].ny*f[i].ny + f[i].nz*f[i].nz);
-			f[i].nx /= m;
-			f[i].ny /= m;
-			f[i].nz /= m;
-
-			float d = (X(f[i].a)/Z(f[i].a)-cx/cz)*f[i].nx + (Y(f[i].a)/Z(f[i].a)-cy/cz)*f[i].ny + (Z(f[i].a)-cz)*f[i].nz;
-			if(d < 0) {
-				f[i].nx *= -1;
-				f[i].ny *= -1;
-				f[i].nz *= -1;
-			}
-			if(f[i].nz < 0) // draw only if triangle faces camera
-				draw_face(f+i);
-		}
-	} else {
-		for(i = 0; i < total_faces; i++)
-			draw_face(f+i);
+	for(i = 0; i < total_vertices; i++) {
+		if(!vertex_used[i]) continue;
+		vertex_normal(v+i, cx, cy, cz);
+
+		// now we are ready to calculate light value for this vertex
+		float c[3] = {0, 0, 0};
+		int j;
+		for(j = 0; j < total_lights; ++j)
+			add_light(v+i, light_buffer+j, 1, c);
+		R(v+i) += c[0];
+		G(v+i) += c[1];
+		B(v+i) += c[2];
 	}
-
-
-	draw_type = D3D_NOTHING;
 }
 
-void D3D_Color(float r, float g, float b) {
-	rR = r;
-	rG = g;
-	rB = b;
-	rA = 1;
+// find lighting baked for arrays under current matrix, or entry to bake
+// it into in place of least recently used one
+static BakedMesh *baked_mesh(int *full) {
+	BakedMesh *b = baked, *lru = baked;
+	int i;
+
+	baked_clock++;
+	for(i = 0; i < BAKED_MESHES; i++, b++) {
+		if(b->xyz == baking_xyz && b->vertices == total_vertices) {
+			*full = memcmp(b->matrix, tmatrix, sizeof(b->matrix)) != 0;
+			break;
+		}
+		if(!b->xyz || b->used < lru->used) lru = b;
+	}
+	if(i == BAKED_MESHES) {
+		b = lru;
+		b->xyz = baking_xyz;
+		b->vertices = total_vertices;
+		*full = 1;
+	}
+	b->used = baked_clock;
+	return b;
+}
+
+// add light of vertex arrays, which is recomputed only for lights, that
+// changed since it was baked, or for all, if they moved or too many did
+static void bake_lights() {
+	Vertex *v = vertex_buffer;
+	int full, i, j;
+
+	BakedMesh *b = baked_mesh(&full);
+	if(full || b->version != lights_version || b->total_lights != total_lights) {
+		static Uint8 changed[MAX_LIGHTS];
+		int n = MAX(b->total_lights, total_lights), total_changed = 0;
+		for(j = 0; j < n; j++) {
+			changed[j] = j >= b->total_lights || j >= total_lights ||
+				light_versions[j] > b->version;
+			total_changed += changed[j];
+		}
+		if(total_changed*2 > total_lights || b->updates == BAKED_UPDATES)
+			full = 1;
+
+		b->light = grow(b->light, &b->max_light, total_vertices*3, sizeof(float));
+		if(full) {
+			memset(b->light, 0, total_vertices*3*sizeof(float));
+			memset(changed, 1, total_lights);
+			n = total_lights;
+			b->total_lights = 0; // nothing to take back
+			b->updates = 0;
+		} else {
+			b->updates++;
+		}
+
+		// normals are same as light_vertices gives
+		float cx = 0, cy = 0, cz = 0;
+		for(i = 0; i < total_vertices; i++) {
+			cx += X(v+i);
+			cy += Y(v+i);
+			cz += Z(v+i);
+		}
+		cx /= total_vertices;
+		cy /= total_vertices;
+		cz /= total_vertices;
+
+		for(i = 0; i < total_vertices; i++) {
+			float *c = b->light + i*3;
+			vertex_normal(v+i, cx, cy, cz);
+			for(j = 0; j < n; j++) {
+				if(!changed[j]) continue;
+				if(j < b->total_lights) add_light(v+i, b->lights+j, -1, c);
+				if(j < total_lights) add_light(v+i, light_buffer+j, 1, c);
+			}
+		}
+
+		b->lights = grow(b->lights, &b->max_lights, total_lights, sizeof(Light));
+		memcpy(b->lights, light_buffer, total_lights*sizeof(Light));
+		b->total_lights = total_lights;
+		b->version = lights_version;
+		memcpy(b->matrix, tmatrix, sizeof(b->matrix));
+	}
+
+	for(i = 0; i < total_vertices; i++) {
+		float *c = b->light + i*3;
+		R(v+i) += c[0];
+		G(v+i) += c[1];
+		B(v+i) += c[2];
+	}
+}
+
+static void set_perspective(int p) {
+	switch(p) {
+	case D3D_AFFINE:		run_length = 0; break;
+	case D3D_SUBDIV16:		run_length = 16; break;
+	case D3D_SUBDIV8:		run_length = 8; break;
+	case D3D_PERSPECTIVE:	run_length = 1; break;
+	default: assert(0); return;
+	}
+	perspective = p;
+}
+
+static void save_state(RasterState *s) {
+	s->texture = texture;
+	s->mapper = mapper;
+	s->flags = flags;
+	s->perspective = perspective;
+	s->ambient_r = ambient_r;
+	s->ambient_g = ambient_g;
+	s->ambient_b = ambient_b;
+}
+
+static void load_state(RasterState *s) {
+	texture = s->texture;
+	mapper = s->mapper;
+	flags = s->flags;
+	set_perspective(s->perspective);
+	ambient_r = s->ambient_r;
+	ambient_g = s->ambient_g;
+	ambient_b = s->ambient_b;
+}
+
+// makes sure dynamic array 'p' of 'size'-byte elements has room for 'n'
+// NOTE: memory is 16-byte aligned, as Vertex needs it
+static void *grow(void *p, int *max, int n, int size) {
+	if(n <= *max) return p;
+
+	int m = MAX(n, *max*2);
+	void *q = memalign(16, m*size);
+	if(!q) {
+		printf("out of memory\n");
+		exit(-1);
+	}
+	if(p) memcpy(q, p, *max*size);
+	free(p);
+	*max = m;
+	return q;
+}
+
+// FNV-1a over 4-byte words, which is enough to tell frames apart.
+// NOTE: words are copied out, as they are floats and pointers mostly
+static Uint64 hash_words(Uint64 h, void *p, int n) {
+	Uint8 *b = p;
+	Uint32 w;
+	for(; n--; b += 4) {
+		memcpy(&w, b, 4);
+		h ^= w;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// state, transformed and lit vertices and faces of batch to be deferred
+static void hash_batch(Batch *b, int total_faces) {
+	RasterState *s = &b->state;
+	Uint32 st[] = {s->mapper, s->flags, s->perspective, total_vertices,
+		total_faces, b->counted};
+	// near plane clips faces and scales 16 and 24-bit depth
+	float fs[] = {s->ambient_r, s->ambient_g, s->ambient_b, near_clip};
+	void *tex[] = {s->texture, s->texture ? s->texture->pixels : 0};
+	int i;
+
+	Uint64 h = hash_words(frame_hash, st, sizeof(st)/4);
+	h = hash_words(h, fs, sizeof(fs)/4);
+	h = hash_words(h, tex, sizeof(tex)/4);
+	h = hash_words(h, vertex_buffer, total_vertices*sizeof(Vertex)/4);
+	for(i = 0; i < total_faces; i++) {
+		Uint32 fi[] = {face_buffer[i].a - vertex_buffer,
+			face_buffer[i].b - vertex_buffer, face_buffer[i].c - vertex_buffer};
+		h = hash_words(h, fi, 3);
+	}
+	frame_hash = h;
+}
+
+// keep current batch until D3D_Flush
+static void defer_batch(int total_faces, int depth_done, int spans_done) {
+	int i;
+
+	batches = grow(batches, &max_batches, total_batches+1, sizeof(Batch));
+	Batch *b = &batches[total_batches++];
+	save_state(&b->state);
+	b->first_vertex = total_frame_vertices;
+	b->first_face = total_frame_faces;
+	b->total_faces = total_faces;
+	b->depth_done = depth_done;
+	b->spans_done = spans_done;
+	b->counted = query_active && !depth_done;
+	if(MEMOIZING()) hash_batch(b, total_faces);
+
+	frame_vertices = grow(frame_vertices, &max_frame_vertices,
+		total_frame_vertices + total_vertices, sizeof(Vertex));
+	memcpy(frame_vertices + total_frame_vertices, vertex_buffer,
+		total_vertices*sizeof(Vertex));
+	total_frame_vertices += total_vertices;
+
+	frame_faces = grow(frame_faces, &max_frame_faces,
+		total_frame_faces + total_faces, sizeof(FaceIndex));
+	FaceIndex *fi = frame_faces + total_frame_faces;
+	for(i = 0; i < total_faces; i++, fi++) {
+		fi->a = face_buffer[i].a - vertex_buffer;
+		fi->b = face_buffer[i].b - vertex_buffer;
+		fi->c = face_buffer[i].c - vertex_buffer;
+	}
+	total_frame_faces += total_faces;
+}
+
+static void flush();
+
+// draw deferred batches, memoized frame gets drawn as it goes from now
+// on, as renderer is about to read or change target
+static void draw_frame() {
+	if(MEMOIZING()) frame_drawing = 1;
+	flush();
+}
+
+// cull, sort, light and then draw or defer first 'total_faces' faces
+// of face_buffer, which refer to 'total_vertices' of vertex_buffer
+// drop faces, which are behind viewer or turned away from him, and sort
+// the rest, if state asks for it. Returns faces left
+static int clip_faces(Face *faces, int total_faces) {
+	Face *f, *d = faces;
+	int i;
+
+	for(i = 0, f = faces; i < total_faces; i++, f++) {
+		if(Z(f->a) < near_clip && Z(f->b) < near_clip && Z(f->c) < near_clip)
+			continue;
+		if((flags & D3D_CULLING) && !is_front_face(f))
+			continue;
+		*d++ = *f;
+	}
+	total_faces = d-faces;
+
+	if(total_faces > 1 && (flags & D3D_BLENDING ?
+	   flags & D3D_SORT_BLENDED : flags & D3D_SORT_OPAQUE)) {
+		sort_faces(faces, total_faces, flags & D3D_BLENDING);
+	}
+	return total_faces;
+}
+
+// move vertices into view space and pick faces, which it shows
+static void view_faces(View *v, int total_faces) {
+	float *m = v->matrix;
+	int i;
+
+	v->vertices = grow(v->vertices, &v->max_vertices, total_vertices, sizeof(Vertex));
+	for(i = 0; i < total_vertices; i++) {
+		Vertex *p = vertex_buffer+i, *q = v->vertices+i;
+		*q = *p;
+		X(q) = m[0]*X(p) + m[4]*Y(p) + m[ 8]*Z(p) + m[12];
+		Y(q) = m[1]*X(p) + m[5]*Y(p) + m[ 9]*Z(p) + m[13];
+		Z(q) = m[2]*X(p) + m[6]*Y(p) + m[10]*Z(p) + m[14];
+	}
+
+	v->faces = grow(v->faces, &v->max_faces, total_faces, sizeof(Face));
+	for(i = 0; i < total_faces; i++) {
+		Face *f = face_buffer+i;
+		v->faces[i].a = v->vertices + (f->a - vertex_buffer);
+		v->faces[i].b = v->vertices + (f->b - vertex_buffer);
+		v->faces[i].c = v->vertices + (f->c - vertex_buffer);
+	}
+	v->total_faces = clip_faces(v->faces, total_faces);
+}
+
+// draw faces of view into its target, as current thread
+static void draw_view(View *v) {
+	int i;
+	STAGE_START(start);
+
+	screen = v->target;
+	zbuffer = v->zbuffer;
+	tiled = 0;
+	span_flags = (views_span_flags & ~SPAN_BUFFER_FLAGS) | buffer_flags();
+	for(i = 0; i < v->total_faces; i++)
+		draw_face(v->faces+i);
+	trace_stages(start);
+}
+
+static int view_thread(void *data) {
+	View *v = data;
+
+	trace_thread("view");
+	for(;;) {
+		SDL_SemWait(v->start);
+		if(v->quit) break;
+
+		TRACE_BEGIN("view");
+		memset(&stats, 0, sizeof(stats));
+		query_pixels = 0;
+		draw_view(v);
+		v->stats = stats;
+		v->query_pixels = query_pixels;
+		TRACE_END("view");
+		SDL_SemPost(v->done);
+	}
+	return 0;
+}
+
+// faces are lit once, in space of current matrix, then each view takes
+// them into its own. With D3D_VIEW_THREADS first view is drawn by this
+// thread, while others are drawn by threads of their own
+static void render_views(int total_faces) {
+	SDL_Surface *s = screen;
+	float *z = zbuffer;
+	int t = tiled, i;
+	int threads = flags & D3D_VIEW_THREADS;
+
+	TRACE_BEGIN("state");
+	screen = views[0].target;
+	tiled = 0;
+	setup_raster();
+	views_span_flags = span_flags;
+	TRACE_END("state");
+
+	if((flags & D3D_LIGHTS) && !(flags & D3D_TEST_ONLY)) {
+		TRACE_BEGIN("lighting");
+		if(baking_xyz) bake_lights();
+		else light_vertices(total_faces);
+		TRACE_END("lighting");
+	}
+
+	TRACE_BEGIN("cull");
+	for(i = 0; i < total_views; i++) view_faces(views+i, total_faces);
+	TRACE_END("cull");
+
+	TRACE_BEGIN("draw");
+	for(i = 1; threads && i < total_views; i++) {
+		View *v = views+i;
+		if(!v->thread) {
+			v->start = SDL_CreateSemaphore(0);
+			v->done = SDL_CreateSemaphore(0);
+			v->thread = SDL_CreateThread(view_thread, v);
+		}
+		SDL_SemPost(v->start);
+	}
+	for(i = 0; i < total_views; i++)
+		if(!i || !threads) draw_view(views+i);
+	for(i = 1; threads && i < total_views; i++) {
+		View *v = views+i;
+		SDL_SemWait(v->done);
+		stats.triangles += v->stats.triangles;
+		stats.pixels += v->stats.pixels;
+		query_pixels += v->query_pixels;
+	}
+	TRACE_END("draw");
+
+	screen = s;
+	zbuffer = z;
+	tiled = t;
+}
+
+static void render_faces(int total_faces) {
+	int i;
+
+	if(total_views) {
+		render_views(total_faces);
+		return;
+	}
+
+	TRACE_BEGIN("state");
+	setup_raster();
+	TRACE_END("state");
+
+	// faces are dropped before spending any time on their lighting
+	TRACE_BEGIN("cull");
+	total_faces = clip_faces(face_buffer, total_faces);
+	TRACE_END("cull");
+
+	if((flags & D3D_LIGHTS) && !(flags & D3D_TEST_ONLY)) { // calculate lights
+		TRACE_BEGIN("lighting");
+		if(baking_xyz) bake_lights();
+		else light_vertices(total_faces);
+		TRACE_END("lighting");
+	}
+
+	// faces are drawn or deferred, time of their clipping, setup and
+	// spans goes into stages within
+	TRACE_BEGIN("draw");
+	// tested faces leave no trace, so they are never deferred and see
+	// depth of everything submitted before them. Opaque faces without
+	// z-test cover everything drawn before them, so deferred faces can't
+	// be shaded after them, they go in order as well
+	int in_order = !(flags & (D3D_ZTEST|D3D_BLENDING)) && !MEMOIZING();
+	if(in_order && total_batches) {
+		// faces after these are tested against depth of flushed ones,
+		// as span buffer starts empty again
+		depth_kept = 1;
+		draw_frame();
+	} else if(flags & D3D_TEST_ONLY) draw_frame();
+	STAGE_START(start);
+	if(!(flags & D3D_TEST_ONLY) && !in_order && (total_batches ||
+	   MEMOIZING() || (flags & (D3D_DEPTH_PREPASS|D3D_SPAN_BUFFER)))) {
+		// opaque faces lay down their depth, or their spans, now and get
+		// shaded by D3D_Flush, others are deferred as well to keep order.
+		// Memoized frame isn't drawn before D3D_Present, so it has none
+		int opaque = (flags & D3D_ZTEST) && !(flags & D3D_BLENDING) &&
+			!MEMOIZING();
+		int spans = opaque && (flags & D3D_SPAN_BUFFER);
+		int prepass = opaque && !spans && (flags & D3D_DEPTH_PREPASS);
+		if(spans) {
+			if(!sbuffer_h) { // first faces since flush
+				sbuffer_rows = grow(sbuffer_rows, &max_sbuffer_rows,
+					screen->h, sizeof(int));
+				memset(sbuffer_rows, 0xff, screen->h*sizeof(int));
+				sbuffer_h = screen->h;
+			}
+			setup_depth_pass();
+			sbuffer_pass = SBUFFER_INSERT;
+			for(i = 0; i < total_faces; i++) {
+				sbuffer_face = total_frame_faces + i;
+				draw_face(face_buffer+i);
+			}
+			sbuffer_pass = 0;
+		}
+		if(prepass) {
+			setup_depth_pass();
+			for(i = 0; i < total_faces; i++)
+				draw_face(face_buffer+i);
+		}
+		defer_batch(total_faces, prepass, spans);
+	} else {
+		for(i = 0; i < total_faces; i++)
+			draw_face(face_buffer+i);
+	}
+	trace_stages(start);
+	TRACE_END("draw");
+}
+
+void D3D_Begin(int t) {
+	RECORD(CAPTURE_BEGIN, int, t);
+	draw_type = t;
+	assert(0 < draw_type && draw_type <= D3D_QUAD_STRIP);
+	total_vertices = 0;
+}
+
+void D3D_End() {
+	int i;
+	Vertex *v = vertex_buffer;
+	Face *f = face_buffer;
+
+	RECORD0(CAPTURE_END);
+	TRACE_BEGIN("D3D_End");
+	TRACE_BEGIN("geometry");
+	assert(total_vertices != 0);
+	if(total_vertices == 1) assert(draw_type == D3D_POINTS);
+	else if(total_vertices == 2) assert(draw_type == D3D_LINES);
+
+	switch(draw_type) {
+	case D3D_POINTS:
+		// not implemented
+		break;
+	case D3D_LINES:
+		// not implemented
+		break;
+	case D3D_TRIANGLES:
+		total_vertices -= total_vertices % 3;
+		for(i = 0; i < total_vertices; i += 3, f++) {
+			f->a = v+i;
+			f->b = v+i+1;
+			f->c = v+i+2;
+		}
+		break;
+	case D3D_TRIANGLE_FAN: // every next connected to the first and previous
+		for(i = 2; i < total_vertices; i++, f++) {
+			f->a = v;
+			f->b = v+i-1;
+			f->c = v+i;
+		}
+		break;
+	case D3D_TRIANGLE_STRIP: // every one connected to two previous
+		// NOTE: every second triangle is flipped to keep winding same
+		for(i = 2; i < total_vertices; i++, f++) {
+			f->a = v+i-2+(i&1);
+			f->b = v+i-1-(i&1);
+			f->c = v+i;
+		}
+		break;
+	case D3D_QUADS:
+		total_vertices -= total_vertices % 4;
+		for(i = 0; i < total_vertices; i+=4) {
+			f->a = v+i;
+			f->b = v+i+1;
+			f->c = v+i+2;
+			f++;
+			f->a = v+i;
+			f->b = v+i+2;
+			f->c = v+i+3;
+			f++;
+		}
+		break;
+	case D3D_QUAD_STRIP: // every two connected to two previous
+		for(i = 2; i < total_vertices; i++, f++) {
+			f->a = v+i-2+(i&1);
+			f->b = v+i-1-(i&1);
+			f->c = v+i;
+		}
+		break;
+	}
+
+	TRACE_END("geometry");
+
+	render_faces(f-face_buffer);
+	draw_type = D3D_NOTHING;
+	TRACE_END("D3D_End");
+}
+
+// vertex arrays used by D3D_DrawElements
+static int array_vertices;
+static float *array_xyz, *array_normals, *array_uvs;
+
+static void capture_screen(SDL_Surface *s) {
+	SDL_PixelFormat *f = s->format;
+	RECORD(CAPTURE_SCREEN, Uint32, s->w, s->h, f->BitsPerPixel,
+		f->Rmask, f->Gmask, f->Bmask, f->Amask);
+}
+
+// record setting of texture, writing it out first, if it wasn't yet
+static void capture_texture(SDL_Surface *t) {
+	CapturedTexture *c = captured;
+	int i;
+
+	if(!t) {
+		RECORD(CAPTURE_SET_TEXTURE, Uint32, 0);
+		return;
+	}
+
+	for(i = 0; i < total_captured; i++, c++)
+		if(c->surface == t) break;
+	if(i == total_captured) {
+		captured = grow(captured, &max_captured, total_captured+1,
+			sizeof(CapturedTexture));
+		c = captured + total_captured++;
+		c->surface = t;
+		c->pixels = 0;
+	}
+
+	// surface changes its pixels, when texture loaded in background
+	// is swapped in, so every version gets an id of its own
+	if(c->pixels != t->pixels || c->w != t->w || c->h != t->h) {
+		static int last_id;
+		SDL_PixelFormat *f = t->format;
+		CaptureTexture h = {++last_id, t->w, t->h, t->pitch, f->BitsPerPixel,
+			f->Rmask, f->Gmask, f->Bmask, f->Amask, 0};
+		if(f->palette) h.colors = f->palette->ncolors;
+
+		record(CAPTURE_TEXTURE, &h, sizeof(h)/4);
+		if(h.colors) fwrite(f->palette->colors, 4, h.colors, capture);
+		fwrite(t->pixels, t->pitch, t->h, capture);
+
+		c->pixels = t->pixels;
+		c->w = t->w;
+		c->h = t->h;
+		c->id = last_id;
+	}
+	RECORD(CAPTURE_SET_TEXTURE, Uint32, c->id);
+}
+
+// vertex arrays are written whole for every draw, as user can change
+// them any time
+static void capture_elements(int count, int index_size, void *indices) {
+	static Uint32 zero;
+	CaptureElements h = {D3D_TRIANGLES, count, index_size, array_vertices,
+		array_normals != 0, array_uvs != 0};
+	int size = count*index_size;
+
+	record(CAPTURE_ELEMENTS, &h, sizeof(h)/4);
+	fwrite(array_xyz, 12, array_vertices, capture);
+	if(array_normals) fwrite(array_normals, 12, array_vertices, capture);
+	if(array_uvs) fwrite(array_uvs, 8, array_vertices, capture);
+	fwrite(indices, 1, size, capture);
+	fwrite(&zero, 1, -size & 3, capture);
+}
+
+void D3D_VertexArrays(int vertices, float *xyz, float *normals, float *uvs) {
+	array_vertices = vertices;
+	array_xyz = xyz;
+	array_normals = normals;
+	array_uvs = uvs;
+}
+
+void D3D_DrawElements(int type, int count, int index_size, void *indices) {
+	Vertex *p = vertex_buffer;
+	Face *f = face_buffer;
+	float *m = tmatrix;
+	int i;
+
+	assert(type == D3D_TRIANGLES);
+	assert(index_size == 2 || index_size == 4);
+	if(array_vertices > MAX_VERTICES || count/3 > MAX_FACES) {
+		printf("vertex buffer overflow\n");
+		exit(-1);
+	}
+
+	if(capture) capture_elements(count, index_size, indices);
+	TRACE_BEGIN("D3D_DrawElements");
+	TRACE_BEGIN("geometry");
+	// arrays are read in place, current color goes to every vertex
+	for(i = 0; i < array_vertices; i++, p++) {
+		float *s = array_xyz + i*3;
+		X(p) = m[0]*s[0] + m[4]*s[1] + m[ 8]*s[2] + m[12];
+		Y(p) = m[1]*s[0] + m[5]*s[1] + m[ 9]*s[2] + m[13];
+		Z(p) = m[2]*s[0] + m[6]*s[1] + m[10]*s[2] + m[14];
+
+		if(array_normals) {
+			s = array_normals + i*3;
+			NX(p) = s[0];
+			NY(p) = s[1];
+			NZ(p) = s[2];
+		} else {
+			NX(p) = rNX;
+			NY(p) = rNY;
+			NZ(p) = rNZ;
+		}
+
+		R(p) = rR;
+		G(p) = rG;
+		B(p) = rB;
+		A(p) = rA;
+
+		if(array_uvs) {
+			U(p) = array_uvs[i*2];
+			V(p) = array_uvs[i*2+1];
+		} else {
+			U(p) = rU;
+			V(p) = rV;
+		}
+	}
+	total_vertices = array_vertices;
+
+	count -= count % 3;
+	if(index_size == 2) {
+		Uint16 *x = (Uint16*)indices;
+		for(i = 0; i < count; i += 3, f++) {
+			f->a = vertex_buffer + x[i];
+			f->b = vertex_buffer + x[i+1];
+			f->c = vertex_buffer + x[i+2];
+		}
+	} else {
+		Uint32 *x = (Uint32*)indices;
+		for(i = 0; i < count; i += 3, f++) {
+			f->a = vertex_buffer + x[i];
+			f->b = vertex_buffer + x[i+1];
+			f->c = vertex_buffer + x[i+2];
+		}
+	}
+	TRACE_END("geometry");
+
+	if(flags & D3D_BAKE_LIGHTS) baking_xyz = array_xyz;
+	render_faces(f-face_buffer);
+	baking_xyz = 0;
+	TRACE_END("D3D_DrawElements");
+}
+
+static void draw_batch(Batch *b, int depth_needed) {
+	Vertex *v = frame_vertices + b->first_vertex;
+	FaceIndex *fi = frame_faces + b->first_face;
+	int i;
+
+	TRACE_BEGIN("batch");
+	STAGE_START(start);
+	load_state(&b->state);
+	setup_raster();
+	if(b->depth_done) span_flags |= SPAN_ZEQUAL;
+	// batch is counted by query, which was active when it was submitted
+	span_flags &= ~SPAN_COUNT;
+	if(b->counted) span_flags |= SPAN_COUNT;
+	if(b->spans_done) {
+		// visibility is resolved already, depth is kept only for faces
+		// drawn after these
+		if(!depth_needed) span_flags &= ~D3D_ZTEST;
+		sbuffer_pass = SBUFFER_SHADE;
+	}
+
+	for(i = 0; i < b->total_faces; i++, fi++) {
+		Face f = {v + fi->a, v + fi->b, v + fi->c};
+		sbuffer_face = b->first_face + i;
+		draw_face(&f);
+	}
+	sbuffer_pass = 0;
+	trace_stages(start);
+	TRACE_END("batch");
+}
+
+// name of cache file for image at 'path' (FNV-1a hash of path)
+static void cache_name(char *name, char *path, char *suffix) {
+	unsigned long long h = 14695981039346656037ULL;
+	char *p;
+	for(p = path; *p; p++) {
+		h ^= (Uint8)*p;
+		h *= 1099511628211ULL;
+	}
+	sprintf(name, "%s/%016llx%s", cache_dir, h, suffix);
+}
+
+static void cache_header(CacheHeader *h, char *path, struct stat *st) {
+	memset(h, 0, sizeof(CacheHeader));
+	h->magic = CACHE_MAGIC;
+	h->version = CACHE_VERSION;
+	h->mtime = st->st_mtime;
+	h->size = st->st_size;
+	h->bpp = texture_format.BitsPerPixel;
+	h->rmask = texture_format.Rmask;
+	h->gmask = texture_format.Gmask;
+	h->bmask = texture_format.Bmask;
+	h->amask = texture_format.Amask;
+	strcpy(h->path, path);
+}
+
+// map cached texture, if it is there and matches 'expect'
+static SDL_Surface *cache_read(char *name, CacheHeader *expect) {
+	struct stat st;
+	int fd = open(name, O_RDONLY);
+	if(fd < 0) return 0;
+	if(fstat(fd, &st) < 0 || st.st_size < CACHE_DATA) {
+		close(fd);
+		return 0;
+	}
+	void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) return 0;
+
+	CacheHeader *h = (CacheHeader*)p;
+	// header is compared up to size of texture, which can't be expected
+	if(memcmp(h, expect, (char*)&h->w - (char*)h) ||
+	   strcmp(h->path, expect->path) ||
+	   st.st_size < CACHE_DATA + h->pitch*h->h) {
+		munmap(p, st.st_size);
+		return 0;
+	}
+
+	Mapping *m = (Mapping*)malloc(sizeof(Mapping));
+	m->addr = p;
+	m->length = st.st_size;
+	SDL_mutexP(cache_lock);
+	m->next = mappings;
+	mappings = m;
+	SDL_mutexV(cache_lock);
+
+	// surface doesn't own its pixels, so they stay mapped after its free
+	return SDL_CreateRGBSurfaceFrom((Uint8*)p + CACHE_DATA, h->w, h->h,
+		h->bpp, h->pitch, h->rmask, h->gmask, h->bmask, h->amask);
+}
+
+// store converted texture. It is written under temporary name and
+// renamed, so other process never maps half-written file. Name has both
+// process and thread, as thread ids are reused across processes
+static void cache_write(char *name, CacheHeader *h, SDL_Surface *t) {
+	char tmp[1100];
+	static char pad[CACHE_DATA];
+	cache_name(tmp, h->path, "");
+	sprintf(tmp + strlen(tmp), ".%d.%u.tmp", (int)getpid(), SDL_ThreadID());
+
+	FILE *f = fopen(tmp, "wb");
+	if(!f) return;
+	h->w = t->w;
+	h->h = t->h;
+	h->pitch = t->pitch;
+	int ok = fwrite(h, sizeof(CacheHeader), 1, f) == 1 &&
+		fwrite(pad, CACHE_DATA - sizeof(CacheHeader), 1, f) == 1 &&
+		fwrite(t->pixels, t->pitch*t->h, 1, f) == 1;
+	ok = !fclose(f) && ok;
+	if(!ok || rename(tmp, name) < 0) unlink(tmp);
+}
+
+// decode image file into texture format, 0 if it can't be loaded
+static SDL_Surface *load_texture(char *path) {
+	CacheHeader h;
+	char name[1100];
+	struct stat st;
+	SDL_Surface *t;
+
+	int cached = cache_dir && strlen(path) < sizeof(h.path) &&
+		!stat(path, &st);
+	if(cached) {
+		cache_header(&h, path, &st);
+		cache_name(name, path, ".tex");
+		if((t = cache_read(name, &h))) return t;
+	}
+
+	SDL_Surface *s = IMG_Load(path);
+	if(!s) {
+		printf("cant load texture '%s'\n", path);
+		return 0;
+	}
+	t = SDL_ConvertSurface(s, &texture_format, SDL_SWSURFACE);
+	SDL_FreeSurface(s);
+
+	if(cached && t) cache_write(name, &h, t);
+	return t;
+}
+
+static int loader(void *data) {
+	trace_thread("loader");
+	for(;;) {
+		SDL_SemWait(load_jobs);
+		SDL_mutexP(load_lock);
+		LoadJob *j = queued;
+		if(j) {
+			queued = j->next;
+			if(!queued) queued_end = &queued;
+		}
+		SDL_mutexV(load_lock);
+		if(!j) break; // woken by D3D_Quit
+
+		TRACE_BEGIN("load texture");
+		j->result = load_texture(j->path);
+		TRACE_END("load texture");
+
+		SDL_mutexP(load_lock);
+		j->next = loaded;
+		loaded = j;
+		SDL_mutexV(load_lock);
+	}
+	return 0;
+}
+
+// put loaded textures into their placeholders. Surface is swapped with
+// all its fields, so pointers held by user and batches remain valid
+static void swap_textures() {
+	if(!pending_textures) return;
+
+	SDL_mutexP(load_lock);
+	LoadJob *j = loaded;
+	loaded = 0;
+	SDL_mutexV(load_lock);
+
+	while(j) {
+		LoadJob *next = j->next;
+		if(j->result) {
+			static_valid = 0; // it may show placeholder
+			__sync_add_and_fetch(&texture_generation, 1);
+			SDL_Surface t = *j->target;
+			*j->target = *j->result;
+			*j->result = t;
+			j->target->refcount = t.refcount;
+			j->result->refcount = 1;
+			SDL_FreeSurface(j->result); // placeholder pixels go away
+		}
+		free(j->path);
+		free(j);
+		pending_textures--;
+		j = next;
+	}
+}
+
+SDL_Surface *D3D_LoadTextureAsync(char *path) {
+	int i;
+
+	if(!load_lock) { // start loaders on first request
+		load_lock = SDL_CreateMutex();
+		load_jobs = SDL_CreateSemaphore(0);
+		for(i = 0; i < LOADER_THREADS; i++)
+			loaders[i] = SDL_CreateThread(loader, 0);
+	}
+
+	// placeholder is single opaque gray texel
+	SDL_Surface *t = SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, 32,
+		texture_format.Rmask, texture_format.Gmask,
+		texture_format.Bmask, texture_format.Amask);
+	*(Uint32*)t->pixels = 0xff808080;
+
+	LoadJob *j = (LoadJob*)malloc(sizeof(LoadJob));
+	j->path = strdup(path);
+	j->target = t;
+	j->result = 0;
+	j->next = 0;
+
+	SDL_mutexP(load_lock);
+	*queued_end = j;
+	queued_end = &j->next;
+	SDL_mutexV(load_lock);
+	SDL_SemPost(load_jobs);
+
+	pending_textures++;
+	return t;
+}
+
+int D3D_PendingTextures() {
+	return pending_textures;
+}
+
+SDL_Surface *D3D_LoadTexture(char *path) {
+	return load_texture(path);
+}
+
+// squared distance between BGRA colors over 'channels' of them
+static int color_dist(Uint32 a, Uint32 b, int channels) {
+	int i, d = 0;
+	for(i = 0; i < channels*8; i += 8) {
+		int x = (int)((a >> i) & 0xff) - (int)((b >> i) & 0xff);
+		d += x*x;
+	}
+	return d;
+}
+
+static int sort_channel; // used by channel_cmp
+
+static int channel_cmp(const void *a, const void *b) {
+	return (int)((*(Uint32*)a >> sort_channel) & 0xff) -
+		(int)((*(Uint32*)b >> sort_channel) & 0xff);
+}
+
+// find channel, which values of 'n' texels spread the most
+static void box_range(Uint32 *p, int first, int n, int *range, int *channel) {
+	int i, j;
+	*range = 0;
+	*channel = 0;
+	for(j = 0; j < 32; j += 8) {
+		int lo = 255, hi = 0;
+		for(i = first; i < first+n; i++) {
+			int c = (p[i] >> j) & 0xff;
+			if(c < lo) lo = c;
+			if(c > hi) hi = c;
+		}
+		if(hi-lo > *range) {
+			*range = hi-lo;
+			*channel = j;
+		}
+	}
+}
+
+// median cut quantization of BGRA texels into 256 colors
+static SDL_Surface *prepare_pal8(SDL_Surface *s) {
+	int n = s->w*s->h, i, j, total = 1;
+	int first[256], count[256], range[256], channel[256];
+	Uint32 *p = (Uint32*)malloc(n*sizeof(Uint32));
+	for(i = 0; i < s->h; i++)
+		memcpy(p + i*s->w, (Uint8*)s->pixels + i*s->pitch, s->w*4);
+
+	// split box with widest channel, until there are 256 boxes
+	first[0] = 0;
+	count[0] = n;
+	box_range(p, 0, n, range, channel);
+	while(total < 256) {
+		int best = 0;
+		for(i = 1; i < total; i++)
+			if(range[i] > range[best]) best = i;
+		if(!range[best]) break; // all boxes are of single color
+
+		Uint32 *b = p + first[best];
+		int c = channel[best];
+		sort_channel = c;
+		qsort(b, count[best], sizeof(Uint32), channel_cmp);
+
+		// split at median, but never between texels of same value
+		int m = count[best]/2, v = (b[m] >> c) & 0xff;
+		while(m > 0 && ((b[m-1] >> c) & 0xff) == v) m--;
+		if(!m) while(((b[m] >> c) & 0xff) == v) m++;
+
+		first[total] = first[best] + m;
+		count[total] = count[best] - m;
+		count[best] = m;
+		box_range(p, first[best], count[best], range+best, channel+best);
+		box_range(p, first[total], count[total], range+total, channel+total);
+		total++;
+	}
+
+	SDL_Surface *t = SDL_CreateRGBSurface(SDL_SWSURFACE, s->w, s->h, 8, 0, 0, 0, 0);
+	Uint32 *palette = (Uint32*)t->format->palette->colors;
+	memset(palette, 0, 256*sizeof(Uint32));
+	for(i = 0; i < total; i++) { // box gets average color
+		Uint32 sum[4] = {0, 0, 0, 0}, c = 0;
+		for(j = first[i]; j < first[i]+count[i]; j++) {
+			int k;
+			for(k = 0; k < 4; k++) sum[k] += (p[j] >> k*8) & 0xff;
+		}
+		for(j = 0; j < 4; j++) c |= (sum[j] + count[i]/2)/count[i] << j*8;
+		palette[i] = c;
+	}
+
+	// texels get nearest color, neighbours tend to have same one
+	Uint32 last = 0;
+	int index = 0;
+	for(i = 0; i < s->h; i++) {
+		Uint32 *src = (Uint32*)((Uint8*)s->pixels + i*s->pitch);
+		Uint8 *dst = (Uint8*)t->pixels + i*t->pitch;
+		for(j = 0; j < s->w; j++) {
+			if(!(i|j) || src[j] != last) {
+				int k, d = 0x7fffffff;
+				for(k = 0; k < total; k++) {
+					int e = color_dist(src[j], palette[k], 4);
+					if(e < d) d = e, index = k;
+				}
+				last = src[j];
+			}
+			dst[j] = index;
+		}
+	}
+	free(p);
+	return t;
+}
+
+static Uint32 pack565(Uint32 c) {
+	return ((c >> 8) & 0xf800) | ((c >> 5) & 0x07e0) | ((c >> 3) & 0x1f);
+}
+
+// pick nearest of decoded colors of block for every texel, returns
+// total error. Transparent texels take index 3
+static int fit_block(Uint32 *t, Uint32 c0, Uint32 c1, int transparent, Uint32 *bits) {
+	Uint8 block[4] = {c0, c0 >> 8, c1, c1 >> 8};
+	Uint32 p[4];
+	int i, j, error = 0;
+
+	// colors of block are decoded same way sampler does it
+	block_colors(block, p);
+
+	int colors = c0 > c1 ? 4 : 3;
+	*bits = 0;
+	for(i = 15; i >= 0; i--) {
+		int index = 3, d = 0;
+		if(!transparent || t[i] >> 24 >= 128) {
+			d = 0x7fffffff;
+			for(j = 0; j < colors; j++) {
+				int e = color_dist(t[i], p[j], 3);
+				if(e < d) d = e, index = j;
+			}
+		}
+		*bits = *bits << 2 | index;
+		error += d;
+	}
+	return error;
+}
+
+// BC1 block is encoded with end points at opposite corners of bounding
+// box of its colors. All four diagonals are tried, as channels can go
+// against each other. Block with transparent texels uses 3 color mode
+static void encode_block(Uint32 *t, Uint8 *b) {
+	int i, j, transparent = 0, best = 0x7fffffff;
+	Uint32 lo = 0xffffff, hi = 0, c0 = 0, c1 = 0, bits = 0;
+
+	for(i = 0; i < 16; i++) {
+		if(t[i] >> 24 < 128) {
+			transparent = 1;
+			continue;
+		}
+		for(j = 0; j < 24; j += 8) {
+			Uint32 c = t[i] & (0xff << j);
+			if(c < (lo & (0xff << j))) lo = (lo & ~(0xff << j)) | c;
+			if(c > (hi & (0xff << j))) hi = (hi & ~(0xff << j)) | c;
+		}
+	}
+
+	for(i = 0; i < 4; i++) { // swap green and blue ends of diagonal
+		Uint32 m = (i & 1 ? 0xff00 : 0) | (i & 2 ? 0xff : 0);
+		Uint32 x = pack565((hi & ~m) | (lo & m));
+		Uint32 y = pack565((lo & ~m) | (hi & m)), xy_bits;
+		if(transparent ? x > y : x < y) {
+			Uint32 z = x;
+			x = y;
+			y = z;
+		}
+		int error = fit_block(t, x, y, transparent, &xy_bits);
+		if(error < best) {
+			best = error;
+			c0 = x;
+			c1 = y;
+			bits = xy_bits;
+		}
+	}
+
+	b[0] = c0;
+	b[1] = c0 >> 8;
+	b[2] = c1;
+	b[3] = c1 >> 8;
+	b[4] = bits;
+	b[5] = bits >> 8;
+	b[6] = bits >> 16;
+	b[7] = bits >> 24;
+}
+
+// BC1 texture is kept in 4-bit surface, which rows of blocks take
+// 4 rows each (w/4 blocks of 8 bytes is exactly 4 rows of w/2 bytes)
+static SDL_Surface *prepare_bc1(SDL_Surface *s) {
+	int x, y, i;
+	SDL_Surface *t = SDL_CreateRGBSurface(SDL_SWSURFACE, s->w, s->h, 4, 0, 0, 0, 0);
+
+	for(y = 0; y < s->h; y += 4) {
+		for(x = 0; x < s->w; x += 4) {
+			Uint32 texels[16];
+			for(i = 0; i < 16; i++) {
+				texels[i] = *(Uint32*)((Uint8*)s->pixels +
+					(y + i/4)*s->pitch + (x + i%4)*4);
+			}
+			encode_block(texels, (Uint8*)t->pixels + y*t->pitch + x*2);
+		}
+	}
+	return t;
+}
+
+SDL_Surface *D3D_PrepareTexture(SDL_Surface *s, int format) {
+	SDL_Surface *c = SDL_ConvertSurface(s, &texture_format, SDL_SWSURFACE);
+	SDL_Surface *t = c;
+
+	if(format == D3D_BC1 && (s->w % 4 || s->h % 4)) {
+		printf("BC1 texture should have sides divisible by 4\n");
+		exit(-1);
+	}
+
+	if(format == D3D_PAL8) t = prepare_pal8(c);
+	else if(format == D3D_BC1) t = prepare_bc1(c);
+	if(t != c) SDL_FreeSurface(c);
+
+	// textures can be prepared by any thread
+	__sync_add_and_fetch(&texture_generation, 1);
+	return t;
+}
+
+void D3D_SetTextureCache(char *dir) {
+	if(!cache_lock) cache_lock = SDL_CreateMutex();
+	free(cache_dir);
+	cache_dir = 0;
+	if(!dir) return;
+	mkdir(dir, 0755); // it may exist already
+	cache_dir = strdup(dir);
+}
+
+// draw batches [first, last). Opaque ones are shaded first, as their
+// depth or spans are final already, then the rest goes in order. Faces
+// without z-test, which could paint over them, are never deferred. Depth
+// of static layer is kept in its snapshot, so it is always written, and
+// so it is after batches were flushed to keep order, until it is cleared
+static void draw_batches(int first, int last) {
+	int i, resolved = 0;
+
+	for(i = first; i < last; i++)
+		if(batches[i].depth_done || batches[i].spans_done) resolved++;
+	for(i = first; i < last; i++)
+		if(batches[i].depth_done || batches[i].spans_done)
+			draw_batch(batches+i, static_drawing || depth_kept ||
+				resolved < last - first);
+	for(i = first; i < last; i++)
+		if(!batches[i].depth_done && !batches[i].spans_done)
+			draw_batch(batches+i, 1);
+}
+
+static void clear_screen(Uint32 c);
+static void clear_zbuffer();
+
+static void flush() {
+	RasterState saved;
+	int i, done = 0;
+
+	if(MEMOIZING()) return; // frame is kept until D3D_Present
+	// textures can change only here, when no batches are left to draw
+	if(!total_batches && !total_frame_ops) {
+		swap_textures();
+		return;
+	}
+	TRACE_BEGIN("draw deferred");
+	save_state(&saved);
+
+	// clears of memoized frame go between batches, they were put after
+	for(i = 0; i < total_frame_ops; i++) {
+		FrameOp *o = frame_ops + i;
+		draw_batches(done, o->batches);
+		done = o->batches;
+		if(o->zbuffer) clear_zbuffer();
+		else clear_screen(o->color);
+	}
+	draw_batches(done, total_batches);
+
+	load_state(&saved);
+	total_frame_ops = 0;
+	total_batches = 0;
+	total_sbuffer = 0;
+	sbuffer_h = 0;
+	total_frame_vertices = 0;
+	total_frame_faces = 0;
+	TRACE_END("draw deferred");
+	swap_textures();
+}
+
+void D3D_Flush() {
+	RECORD0(CAPTURE_FLUSH);
+	flush();
+}
+
+void D3D_Color(float r, float g, float b) {
+	RECORD(CAPTURE_COLOR, float, r, g, b, 1);
+	rR = r;
+	rG = g;
+	rB = b;
+	rA = 1;
 }
 
 void D3D_Color4(float r, float g, float b, float a) {
+	RECORD(CAPTURE_COLOR, float, r, g, b, a);
 	rR = r;
 	rG = g;
 	rB = b;
@@ -930,17 +2985,20 @@ void D3D_Color4(float r, float g, float b, float a) {
 }
 
 void D3D_Normal(float x, float y, float z) {
+	RECORD(CAPTURE_NORMAL, float, x, y, z);
 	rNX = x;
 	rNY = y;
 	rNZ = z;
 }
 
 void D3D_TexCoord(float u, float v) {
+	RECORD(CAPTURE_TEX_COORD, float, u, v);
 	rU = u;
 	rV = v;
 }
 
 void D3D_Vertex(float x, float y, float z) {
+	RECORD(CAPTURE_VERTEX, float, x, y, z);
 	if(total_vertices == MAX_VERTICES) {
 		printf("vertex buffer overflow\n");
 		exit(-1);
@@ -969,76 +3027,757 @@ void D3D_Vertex(float x, float y, float z) {
 	++total_vertices;
 }
 
-void D3D_ClearScreen(float r, float g, float b) {
-	Uint32 c = SDL_MapRGB(screen->format, (Uint8)(r*0xff), (Uint8)(g*0xff), (Uint8)(b*0xff));
+// clear is kept along with memoized frame
+static void frame_op(int zbuffer, Uint32 color) {
+	frame_ops = grow(frame_ops, &max_frame_ops, total_frame_ops+1, sizeof(FrameOp));
+	FrameOp *o = &frame_ops[total_frame_ops++];
+	o->batches = total_batches;
+	o->zbuffer = zbuffer;
+	o->color = color;
+	Uint32 h[] = {zbuffer, color};
+	frame_hash = hash_words(frame_hash, h, 2);
+}
 
-	if(c) SDL_FillRect(screen, 0, c);
+static void clear_screen(Uint32 c) {
+	TRACE_BEGIN("clear");
+	if(tiled) {
+		int i, n = tiles_w*TILE*((screen->h+TILE-1) & ~(TILE-1));
+		if(!c) memset(tiles, 0, n*screen->format->BytesPerPixel);
+		else if(screen->format->BytesPerPixel == 2)
+			for(i = 0; i < n; i++) ((Uint16*)tiles)[i] = c;
+		else
+			for(i = 0; i < n; i++) ((Uint32*)tiles)[i] = c;
+	} else if(c) SDL_FillRect(screen, 0, c);
 	else memset(screen->pixels, 0, screen->w*screen->h*screen->format->BytesPerPixel);
+	TRACE_END("clear");
+}
+
+static void clear_zbuffer() {
+	TRACE_BEGIN("clear");
+	int w = (screen->w+TILE-1) & ~(TILE-1), h = (screen->h+TILE-1) & ~(TILE-1);
+	memset(zbuffer, 0, w*h*(depth_bits == 16 ? 2 : 4));
+	depth_kept = 0;
+	TRACE_END("clear");
+}
+
+void D3D_ClearScreen(float r, float g, float b) {
+	RECORD(CAPTURE_CLEAR_SCREEN, float, r, g, b);
+	if(total_views) {
+		SDL_Surface *s = screen;
+		int t = tiled, i;
+		tiled = 0;
+		for(i = 0; i < total_views; i++) {
+			screen = views[i].target;
+			clear_screen(SDL_MapRGB(screen->format,
+				(Uint8)(r*0xff), (Uint8)(g*0xff), (Uint8)(b*0xff)));
+		}
+		screen = s;
+		tiled = t;
+		return;
+	}
+	Uint32 c = SDL_MapRGB(screen->format, (Uint8)(r*0xff), (Uint8)(g*0xff), (Uint8)(b*0xff));
+	if(MEMOIZING()) {
+		frame_op(0, c);
+		return;
+	}
+	flush(); // deferred batches belong to what is cleared
+	clear_screen(c);
 }
 
 void D3D_ClearZBuffer() {
-	memset(zbuffer, 0, screen->w*screen->h*sizeof(float));
+	RECORD0(CAPTURE_CLEAR_ZBUFFER);
+	if(total_views) {
+		SDL_Surface *s = screen;
+		float *z = zbuffer;
+		int i;
+		for(i = 0; i < total_views; i++) {
+			screen = views[i].target;
+			zbuffer = views[i].zbuffer;
+			clear_zbuffer();
+		}
+		screen = s;
+		zbuffer = z;
+		return;
+	}
+	if(MEMOIZING()) {
+		frame_op(1, 0);
+		return;
+	}
+	flush();
+	clear_zbuffer();
 }
 
-void D3D_SetScreen(SDL_Surface *s) {
+static void *alloc_buffer(int size) {
+	void *p = memalign(256, size);
+	if(!p) {
+		printf("out of memory\n");
+		exit(-1);
+	}
+	memset(p, 0, size);
+	return p;
+}
+
+// depth buffer and colour tiles follow screen size. They are padded to
+// whole tiles, with 4 bytes per pixel, which fit every format, so
+// D3D_SetDepthBits doesn't need new ones
+static int target_size; // bytes allocated for each
+
+static void alloc_target(SDL_Surface *s) {
+	int w = (s->w+TILE-1) & ~(TILE-1), h = (s->h+TILE-1) & ~(TILE-1);
+
+	// buffers only grow, as resolution governor resizes target often
+	if(w*h*4 > target_size) {
+		free(zbuffer);
+		free(tiles);
+		target_size = w*h*4;
+		zbuffer = (float*)alloc_buffer(target_size);
+		tiles = 0;
+	}
+	zbuffer_w = s->w;
+	zbuffer_h = s->h;
+	if(tiled && !tiles) tiles = alloc_buffer(target_size);
+	if(!tiled && tiles) {
+		free(tiles);
+		tiles = 0;
+	}
+	tiles_w = w/TILE;
+}
+
+// surface of display format at res_scale of its size. Pixels have row
+// and pixel of padding, which bilinear upscale reads at zero weight
+static SDL_Surface *scaled_target() {
+	SDL_PixelFormat *f = display->format;
+	int w = MAX(1, (int)(display->w*res_scale + 0.5f));
+	int h = MAX(1, (int)(display->h*res_scale + 0.5f));
+
+	if(scaled && scaled->w == w && scaled->h == h &&
+		scaled->format->BitsPerPixel == f->BitsPerPixel) return scaled;
+
+	int pitch = w*f->BytesPerPixel;
+	if((h+1)*pitch + 4 > scaled_size) {
+		free(scaled_pixels);
+		scaled_size = (h+1)*pitch + 4;
+		scaled_pixels = alloc_buffer(scaled_size);
+	}
+	if(scaled) SDL_FreeSurface(scaled); // pixels aren't freed with it
+	scaled = SDL_CreateRGBSurfaceFrom(scaled_pixels, w, h, f->BitsPerPixel,
+		pitch, f->Rmask, f->Gmask, f->Bmask, f->Amask);
+	return scaled;
+}
+
+static void set_target() {
+	SDL_Surface *s = res_scale < 1 ? scaled_target() : display;
+	if(s->w != zbuffer_w || s->h != zbuffer_h) {
+		draw_frame(); // deferred batches are drawn into old buffers
+		alloc_target(s);
+	}
 	screen = s;
 }
 
+void D3D_SetScreen(SDL_Surface *s) {
+	if(capture) capture_screen(s);
+	// deferred batches and clears belong to old screen
+	if(s != display && (total_batches || total_frame_ops)) draw_frame();
+	display = s;
+	set_target();
+}
+
+void D3D_SetViews(int n, float *matrices, SDL_Surface **targets) {
+	int i;
+
+	assert(n >= 0 && n <= MAX_VIEWS);
+	draw_frame(); // deferred faces belong to old target
+	for(i = 0; i < n; i++) {
+		View *v = views+i;
+		SDL_Surface *s = targets[i];
+		int size = ((s->w+TILE-1) & ~(TILE-1))*((s->h+TILE-1) & ~(TILE-1))*4;
+		memcpy(v->matrix, matrices + i*16, sizeof(v->matrix));
+		v->target = s;
+		if(size > v->zbuffer_size) {
+			free(v->zbuffer);
+			v->zbuffer = (float*)alloc_buffer(size);
+			v->zbuffer_size = size;
+		}
+	}
+	total_views = n;
+}
+
+void D3D_SetTiled(int t) {
+	RECORD(CAPTURE_TILED, int, t);
+	draw_frame();
+	tiled = t;
+	if(screen) alloc_target(screen);
+}
+
+// copy colour tiles to screen, rows of 8 tiles after another. Stores
+// bypass cache, as screen isn't read back by renderer
+static void resolve() {
+	int pixel_size = screen->format->BytesPerPixel;
+	int full = screen->w & ~(TILE-1);
+	int y;
+
+	TRACE_BEGIN("resolve");
+	for(y = 0; y < screen->h; y++) {
+		Uint8 *src = tiles + TILE_OFFSET(0, y)*pixel_size;
+		Uint8 *dst = (Uint8*)screen->pixels + y*screen->pitch;
+		if(full) asm volatile(
+			"1:\n\t"
+			"movq (%%esi),%%mm0\n\t"
+			"movq 8(%%esi),%%mm1\n\t"
+			"movntq %%mm0,(%%edi)\n\t"
+			"movntq %%mm1,8(%%edi)\n\t"
+			"cmp $2,%%eax\n\t"				// 16-bit tile row is done
+			"je 2f\n\t"
+			"movq 16(%%esi),%%mm0\n\t"
+			"movq 24(%%esi),%%mm1\n\t"
+			"movntq %%mm0,16(%%edi)\n\t"
+			"movntq %%mm1,24(%%edi)\n\t"
+			"2:\n\t"
+			"add %%ebx,%%esi\n\t"			// same row of next tile
+			"add %%ecx,%%edi\n\t"
+			"cmp %%edx,%%edi\n\t"
+			"jb 1b\n\t"
+			: "+S" (src), "+D" (dst)
+			: "a" (pixel_size), "b" (TILE*TILE*pixel_size),
+			  "c" (TILE*pixel_size), "d" (dst + full*pixel_size)
+			: "memory"
+		);
+		if(full < screen->w) // partial tile at right edge
+			memcpy(dst, src, (screen->w - full)*pixel_size);
+	}
+	asm volatile("sfence\n\temms" ::: "memory");
+	TRACE_END("resolve");
+}
+
+// stretch target of reduced resolution over display, bilinear filter
+// works on 32-bit pixels only
+static void upscale() {
+	SDL_Surface *s = screen, *d = display;
+	int pixel_size = d->format->BytesPerPixel;
+	int step_x = ((s->w-1) << 16)/MAX(d->w-1, 1);
+	int step_y = ((s->h-1) << 16)/MAX(d->h-1, 1);
+	static Uint16 mask[4] = {127, 0, 0, 0};
+	int x, y;
+
+	TRACE_BEGIN("upscale");
+	for(y = 0; y < d->h; y++) {
+		int fx = 0, fy = y*step_y;
+		Uint8 *row = (Uint8*)s->pixels + (fy >> 16)*s->pitch;
+		Uint8 *dst = (Uint8*)d->pixels + y*d->pitch;
+
+		if(res_filter == D3D_LINEAR && pixel_size == 4) {
+			Uint16 wy = (fy >> 9) & 127, wy4[4] = {wy, wy, wy, wy};
+			asm volatile(
+				"pxor %%mm7,%%mm7\n\t"
+				"movq %5,%%mm5\n\t"				// mm5 = vertical weight
+				"movq %6,%%mm6\n\t"
+				"1:\n\t"
+				"mov %%ecx,%%eax\n\t"
+				"shr $16,%%eax\n\t"
+				"lea (%%esi,%%eax,4),%%eax\n\t"
+				"movd (%%eax),%%mm0\n\t"			// 2x2 source pixels
+				"movd 4(%%eax),%%mm1\n\t"
+				"movd (%%eax,%%ebx),%%mm2\n\t"
+				"movd 4(%%eax,%%ebx),%%mm3\n\t"
+				"movd %%ecx,%%mm4\n\t"
+				"psrld $9,%%mm4\n\t"
+				"pand %%mm6,%%mm4\n\t"
+				"pshufw $0,%%mm4,%%mm4\n\t"		// mm4 = horizontal weight
+				"punpcklbw %%mm7,%%mm0\n\t"
+				"punpcklbw %%mm7,%%mm1\n\t"
+				"punpcklbw %%mm7,%%mm2\n\t"
+				"punpcklbw %%mm7,%%mm3\n\t"
+				"psubw %%mm0,%%mm1\n\t"
+				"pmullw %%mm4,%%mm1\n\t"
+				"psraw $7,%%mm1\n\t"
+				"paddw %%mm1,%%mm0\n\t"			// mm0 = top
+				"psubw %%mm2,%%mm3\n\t"
+				"pmullw %%mm4,%%mm3\n\t"
+				"psraw $7,%%mm3\n\t"
+				"paddw %%mm3,%%mm2\n\t"			// mm2 = bottom
+				"psubw %%mm0,%%mm2\n\t"
+				"pmullw %%mm5,%%mm2\n\t"
+				"psraw $7,%%mm2\n\t"
+				"paddw %%mm2,%%mm0\n\t"
+				"packuswb %%mm7,%%mm0\n\t"
+				"movd %%mm0,(%%edi)\n\t"
+				"add $4,%%edi\n\t"
+				"add %4,%%ecx\n\t"
+				"cmp %%edx,%%edi\n\t"
+				"jb 1b\n\t"
+				"emms\n\t"
+				: "+D" (dst), "+c" (fx)
+				: "S" (row), "b" (s->pitch), "m" (step_x), "m" (*wy4),
+				  "m" (*mask), "d" (dst + d->w*4)
+				: "eax", "memory"
+			);
+		} else if(pixel_size == 4) {
+			for(x = 0; x < d->w; x++, fx += step_x)
+				((Uint32*)dst)[x] = ((Uint32*)row)[(fx + 0x8000) >> 16];
+		} else {
+			for(x = 0; x < d->w; x++, fx += step_x)
+				((Uint16*)dst)[x] = ((Uint16*)row)[(fx + 0x8000) >> 16];
+		}
+	}
+	TRACE_END("upscale");
+}
+
+// recorded here, as governor picks resolution by frame times, which
+// replay can't repeat
+static void set_resolution(float scale, int filter) {
+	RECORD(CAPTURE_RESOLUTION, float, scale, filter);
+	res_scale = scale;
+	res_filter = filter;
+	total_frame_times = 0;
+	if(display) set_target();
+}
+
+// pixels cost most, so scale, whose square is ratio of budget to mean
+// frame time, would fit frame into budget. Scale rises in smaller steps
+// and only with some headroom, so it doesn't swing back and forth
+static void govern() {
+	Uint32 t = SDL_GetTicks();
+	int i;
+
+	if(frame_budget && last_present)
+		frame_times[total_frame_times++ % FRAME_WINDOW] = t - last_present;
+	last_present = t;
+	if(total_frame_times < FRAME_WINDOW) return;
+
+	float mean = 0;
+	for(i = 0; i < FRAME_WINDOW; i++) mean += frame_times[i];
+	mean /= FRAME_WINDOW;
+
+	// scale is kept in steps of 1/32, so there are few target sizes
+	float scale = res_scale;
+	int filter = res_filter;
+	if(mean > frame_budget) {
+		// at lowest resolution bilinear upscale goes first
+		if(scale <= min_scale) filter = D3D_NEAREST;
+		scale = floor(scale*sqrt(frame_budget/mean)*32)/32;
+	} else if(mean < frame_budget*0.8f) {
+		if(filter == D3D_NEAREST) filter = D3D_LINEAR;
+		else scale = ceil(scale*MIN(sqrt(frame_budget*0.9f/mean), 1.25f)*32)/32;
+	}
+	scale = MAX(min_scale, MIN(scale, 1));
+	if(scale != res_scale || filter != res_filter)
+		set_resolution(scale, filter);
+}
+
+// memoized frame is same as last one, if it was submitted entirely and
+// goes into same surfaces, which weren't drawn on since. Frames are drawn,
+// while textures are loaded, as they are swapped only by D3D_Flush
+static int frame_unchanged() {
+	void *target[] = {display, display->pixels, screen, screen->pixels};
+	frame_hash = hash_words(frame_hash, target, sizeof(target)/4);
+	return last_frame_valid && !frame_redraw && !pending_textures &&
+		frame_hash == last_frame_hash;
+}
+
+int D3D_Present() {
+	int drawn = 1;
+
+	RECORD0(CAPTURE_PRESENT);
+	if(MEMOIZING() && frame_unchanged()) {
+		// deferred frame is dropped, screen has it already
+		total_frame_ops = 0;
+		total_batches = 0;
+		total_frame_vertices = 0;
+		total_frame_faces = 0;
+		drawn = 0;
+	} else {
+		last_frame_hash = frame_hash;
+		last_frame_valid = MEMOIZING();
+		draw_frame();
+		if(tiled) resolve();
+		if(screen != display) upscale();
+	}
+	frame_hash = FRAME_HASH_SEED;
+	frame_drawing = 0;
+	frame_redraw = 0;
+	govern();
+	return drawn;
+}
+
+void D3D_Redraw() {
+	RECORD0(CAPTURE_REDRAW);
+	frame_redraw = 1;
+}
+
+static void static_layer_key(StaticKey *k) {
+	memset(k, 0, sizeof(StaticKey));
+	memcpy(k->matrix, tmatrix, sizeof(k->matrix));
+	k->near_clip = near_clip;
+	k->w = screen->w;
+	k->h = screen->h;
+	k->bpp = screen->format->BytesPerPixel;
+	k->depth_bits = depth_bits;
+	k->tiled = tiled;
+	k->total_lights = total_lights;
+	k->texture = texture;
+	k->pixels = texture ? texture->pixels : 0;
+	k->mapper = mapper;
+	k->flags = flags;
+	k->perspective = perspective;
+	k->front_face = front_face;
+	k->ambient_r = ambient_r;
+	k->ambient_g = ambient_g;
+	k->ambient_b = ambient_b;
+}
+
+// bytes of colour and depth of current target, tiles are copied whole
+static void static_layer_sizes(int *color, int *depth) {
+	int w = (screen->w+TILE-1) & ~(TILE-1), h = (screen->h+TILE-1) & ~(TILE-1);
+	*color = tiled ? w*h*screen->format->BytesPerPixel : screen->pitch*screen->h;
+	*depth = w*h*(depth_bits == 16 ? 2 : 4);
+}
+
+int D3D_BeginStatic() {
+	StaticKey k;
+	int color, depth;
+
+	draw_frame(); // it may swap textures, which static layer has
+	static_layer_key(&k);
+	static_layer_sizes(&color, &depth);
+	if(static_valid && !memcmp(&k, &static_key, sizeof(k)) &&
+	   !memcmp(static_lights, light_buffer, total_lights*sizeof(Light))) {
+		RECORD(CAPTURE_BEGIN_STATIC, int, 0);
+		TRACE_BEGIN("restore static");
+		memcpy(tiled ? tiles : (Uint8*)screen->pixels, static_color, color);
+		memcpy(zbuffer, static_depth, depth);
+		TRACE_END("restore static");
+		return 0;
+	}
+
+	// replay doesn't load textures in background, so it can't tell, when
+	// they invalidated snapshot, and is told instead
+	RECORD(CAPTURE_BEGIN_STATIC, int, 1);
+
+	static_key = k;
+	memcpy(static_lights, light_buffer, total_lights*sizeof(Light));
+	static_valid = 0;
+	static_drawing = 1;
+	return 1;
+}
+
+void D3D_EndStatic() {
+	int color, depth;
+
+	RECORD0(CAPTURE_END_STATIC);
+	if(!static_drawing) return;
+	// textures swapped by this flush were drawn as placeholders, so
+	// they invalidate snapshot again
+	static_valid = 1;
+	draw_frame();
+	static_drawing = 0;
+
+	TRACE_BEGIN("keep static");
+	static_layer_sizes(&color, &depth);
+	if(color > static_color_size) {
+		free(static_color);
+		static_color = alloc_buffer(color);
+		static_color_size = color;
+	}
+	if(depth > static_depth_size) {
+		free(static_depth);
+		static_depth = alloc_buffer(depth);
+		static_depth_size = depth;
+	}
+	memcpy(static_color, tiled ? tiles : (Uint8*)screen->pixels, color);
+	memcpy(static_depth, zbuffer, depth);
+	TRACE_END("keep static");
+}
+
+void D3D_InvalidateStatic() {
+	RECORD0(CAPTURE_INVALIDATE_STATIC);
+	static_valid = 0;
+}
+
+void D3D_SetResolution(float scale, int filter) {
+	assert(scale > 0 && scale <= 1);
+	draw_frame();
+	set_resolution(scale, filter);
+}
+
+void D3D_SetFrameBudget(float ms, float min) {
+	assert(min > 0 && min <= 1);
+	frame_budget = ms;
+	min_scale = min;
+	total_frame_times = 0;
+	if(!ms) {
+		draw_frame();
+		set_resolution(1, D3D_LINEAR);
+	}
+}
+
 void D3D_SetTexture(SDL_Surface *t) {
+	if(capture) capture_texture(t);
 	texture = t;
 }
 
 void D3D_Light(float r, float g, float b) {
+	RECORD(CAPTURE_LIGHT, float, r, g, b);
 	if(total_lights == MAX_LIGHTS) {
 		printf("light buffer overflow\n");
 		exit(-1);
 	}
-	Light *l = &light_buffer[total_lights++];
-	l->x = tmatrix[12];
-	l->y = tmatrix[13];
-	l->z = tmatrix[14];
-	l->r = r;
-	l->g = g;
-	l->b = b;
+	Light n = {tmatrix[12], tmatrix[13], tmatrix[14], r, g, b};
+	Light *l = &light_buffer[total_lights];
+	if(total_lights >= max_set_lights || memcmp(l, &n, sizeof(Light))) {
+		light_versions[total_lights] = ++lights_version;
+		max_set_lights = MAX(max_set_lights, total_lights+1);
+	}
+	*l = n;
+	total_lights++;
+}
+
+void D3D_BeginQuery() {
+	RECORD0(CAPTURE_BEGIN_QUERY);
+	query_active = 1;
+	query_pixels = 0;
+}
+
+void D3D_EndQuery() {
+	RECORD0(CAPTURE_END_QUERY);
+	query_active = 0;
+}
+
+int D3D_GetQueryResult() {
+	return query_pixels;
+}
+
+void D3D_BeginCapture(char *path) {
+	Uint32 header[2] = {CAPTURE_MAGIC, CAPTURE_VERSION};
+	int i;
+
+	capture = fopen(path, "wb");
+	if(!capture) {
+		printf("cant open '%s'\n", path);
+		exit(-1);
+	}
+	fwrite(header, 4, 2, capture);
+	total_captured = 0;
+	static_valid = 0; // replay has to see static layer drawn
+
+	// replay starts from state, renderer has now
+	if(screen) capture_screen(screen);
+	RECORD(CAPTURE_DISABLE, int, ~0);
+	RECORD(CAPTURE_ENABLE, int, flags);
+	RECORD(CAPTURE_MAPPER, int, mapper);
+	RECORD(CAPTURE_DEPTH_BITS, int, depth_bits);
+	RECORD(CAPTURE_TILED, int, tiled);
+	RECORD(CAPTURE_RESOLUTION, float, res_scale, res_filter);
+	RECORD(CAPTURE_PERSPECTIVE, int, perspective);
+	RECORD(CAPTURE_FRONT_FACE, int, front_face);
+	RECORD(CAPTURE_NEAR_CLIP, float, near_clip);
+	RECORD(CAPTURE_AMBIENT, float, ambient_r, ambient_g, ambient_b);
+	RECORD(CAPTURE_COLOR, float, rR, rG, rB, rA);
+	RECORD(CAPTURE_NORMAL, float, rNX, rNY, rNZ);
+	RECORD(CAPTURE_TEX_COORD, float, rU, rV);
+	capture_texture(texture);
+
+	// lights are kept at positions, they were added at, so each one is
+	// added under matrix, which moves it there
+	RECORD0(CAPTURE_CLEAR_LIGHTS);
+	for(i = 0; i < total_lights; i++) {
+		Light *l = light_buffer + i;
+		float m[16];
+		D3D_LoadIdentityM(m);
+		m[12] = l->x;
+		m[13] = l->y;
+		m[14] = l->z;
+		record(CAPTURE_LOAD_MATRIX, m, 16);
+		RECORD(CAPTURE_LIGHT, float, l->r, l->g, l->b);
+	}
+
+	for(i = 0; i <= current_matrix; i++) {
+		if(i) RECORD0(CAPTURE_PUSH);
+		record(CAPTURE_LOAD_MATRIX, matrix_stack[i], 16);
+	}
+}
+
+void D3D_CaptureFrame() {
+	RECORD0(CAPTURE_FRAME);
+}
+
+void D3D_EndCapture() {
+	if(!capture) return;
+	fclose(capture);
+	capture = 0;
+	free(captured);
+	captured = 0;
+	total_captured = max_captured = 0;
+}
+
+void D3D_GetStats(D3D_Stats *s) {
+	*s = stats;
+}
+
+void D3D_ResetStats() {
+	memset(&stats, 0, sizeof(stats));
 }
 
 void D3D_ClearLights() {
+	RECORD0(CAPTURE_CLEAR_LIGHTS);
 	total_lights = 0;
 }
 
 void D3D_SetAmbient(float r, float g, float b) {
+	RECORD(CAPTURE_AMBIENT, float, r, g, b);
 	ambient_r = r;
 	ambient_g = g;
 	ambient_b = b;
 }
 
+void D3D_SetPerspective(int p) {
+	RECORD(CAPTURE_PERSPECTIVE, int, p);
+	set_perspective(p);
+}
+
+void D3D_FrontFace(int w) {
+	assert(w == D3D_CW || w == D3D_CCW);
+	RECORD(CAPTURE_FRONT_FACE, int, w);
+	front_face = w;
+}
+
 void D3D_SetNearClip(float z) {
+	RECORD(CAPTURE_NEAR_CLIP, float, z);
+	// deferred batches are clipped and their depth scaled by old plane
+	if(z != near_clip && (total_batches || total_frame_ops)) draw_frame();
 	near_clip = z;
 }
 
 void D3D_Enable(int f) {
+	RECORD(CAPTURE_ENABLE, int, f);
 	flags |= f;
 }
 
 void D3D_Disable(int f) {
+	RECORD(CAPTURE_DISABLE, int, f);
 	flags &= ~f;
 }
 
 
 void D3D_SetMapper(int m) {
+	RECORD(CAPTURE_MAPPER, int, m);
 	mapper = m;
 }
 
+void D3D_SetDepthBits(int bits) {
+	assert(bits == 16 || bits == 24 || bits == 32);
+	RECORD(CAPTURE_DEPTH_BITS, int, bits);
+	draw_frame(); // deferred batches test against depth of old size
+	depth_bits = bits;
+}
+
+static void init_dither() {
+	static int bayer[4][4] = {
+		{ 0,  8,  2, 10},
+		{12,  4, 14,  6},
+		{ 3, 11,  1,  9},
+		{15,  7, 13,  5}
+	};
+	int x, y;
+
+	for(y = 0; y < 4; y++) {
+		for(x = 0; x < 4; x++) {
+			dither_matrix[y][x][0] = bayer[y][x] >> 1;
+			dither_matrix[y][x][1] = bayer[y][x] >> 2;
+			dither_matrix[y][x][2] = bayer[y][x] >> 1;
+			dither_matrix[y][x][3] = 0;
+		}
+	}
+}
+
 int D3D_Init() {
-	// 1600x1200 should be sufficient
-	zbuffer = (float*)malloc(1600*1200*sizeof(float));
-	D3D_SetMapper(D3D_LINEAR);
-	D3D_LoadIdentity();
-	D3D_SetAmbient(1, 1, 1);
-	//D3D_SetAmbient(0.2, 0.2, 0.2);
+	RECORD0(CAPTURE_INIT);
+	init_dither();
+	mapper = D3D_LINEAR;
+	D3D_LoadIdentityM(tmatrix);
+	ambient_r = ambient_g = ambient_b = 1;
 	return 0;
 }
 
 void D3D_Quit() {
+	int i;
+
+	D3D_EndCapture();
+	if(load_lock) { // drop queued jobs and stop loaders
+		SDL_mutexP(load_lock);
+		while(queued) {
+			LoadJob *j = queued;
+			queued = j->next;
+			free(j->path);
+			free(j);
+			pending_textures--;
+		}
+		queued_end = &queued;
+		SDL_mutexV(load_lock);
+
+		for(i = 0; i < LOADER_THREADS; i++) SDL_SemPost(load_jobs);
+		for(i = 0; i < LOADER_THREADS; i++) SDL_WaitThread(loaders[i], 0);
+		swap_textures();
+
+		SDL_DestroySemaphore(load_jobs);
+		SDL_DestroyMutex(load_lock);
+		load_lock = 0;
+	}
+
+	// textures from cache must not be used after this
+	while(mappings) {
+		Mapping *m = mappings;
+		mappings = m->next;
+		munmap(m->addr, m->length);
+		free(m);
+	}
+
 	free(zbuffer);
+	free(tiles);
+	zbuffer = 0;
+	tiles = 0;
+	zbuffer_w = zbuffer_h = 0;
+	target_size = 0;
+	if(scaled) SDL_FreeSurface(scaled);
+	free(scaled_pixels);
+	scaled = 0;
+	scaled_pixels = 0;
+	scaled_size = 0;
+	free(batches);
+	free(frame_vertices);
+	free(frame_faces);
+	free(sbuffer);
+	free(sbuffer_rows);
+	batches = 0, max_batches = 0;
+	frame_vertices = 0, max_frame_vertices = 0;
+	frame_faces = 0, max_frame_faces = 0;
+	sbuffer = 0, max_sbuffer = 0;
+	sbuffer_rows = 0, max_sbuffer_rows = 0;
+	for(i = 0; i < BAKED_MESHES; i++) {
+		free(baked[i].lights);
+		free(baked[i].light);
+	}
+	memset(baked, 0, sizeof(baked));
+	for(i = 0; i < MAX_VIEWS; i++) {
+		View *v = views+i;
+		if(v->thread) {
+			v->quit = 1;
+			SDL_SemPost(v->start);
+			SDL_WaitThread(v->thread, 0);
+			SDL_DestroySemaphore(v->start);
+			SDL_DestroySemaphore(v->done);
+		}
+		free(v->zbuffer);
+		free(v->vertices);
+		free(v->faces);
+		memset(v, 0, sizeof(View));
+	}
+	total_views = 0;
+	free(frame_ops);
+	frame_ops = 0, max_frame_ops = 0;
+	last_frame_valid = 0;
+	free(static_color);
+	free(static_depth);
+	static_color = static_depth = 0;
+	static_color_size = static_depth_size = 0;
+	static_valid = static_drawing = 0;
 }
@@ -32,12 +32,46 @@
 #define D3D_FLAT				2
 #define D3D_GORAUD				3
 
+// perspective correction modes
+#define D3D_AFFINE				1 /* correct at span ends only */
+#define D3D_SUBDIV16			2 /* correct every 16 pixels */
+#define D3D_SUBDIV8				3 /* correct every 8 pixels */
+#define D3D_PERSPECTIVE			4 /* correct every pixel */
+
+// texture formats for D3D_PrepareTexture
+#define D3D_RGBA32				1 /* 4 bytes per texel */
+#define D3D_PAL8				2 /* 1 byte per texel, 256 colors */
+#define D3D_BC1					3 /* 4x4 blocks of 8 bytes, 4 bits per texel */
+
+// face windings for D3D_FrontFace, as seen on screen
+#define D3D_CW					1
+#define D3D_CCW					2
+
 // flags for D3D_Enable/D3D_Disable
 #define D3D_ZTEST				0x01 /* do z-buffer test*/
 #define D3D_LIGHTS				0x02 /* process scene lights */
 #define D3D_BLENDING			0x04 /* blend transarent objects  */
 #define D3D_CULLING				0x08 /* perform backspace culling */
 #define D3D_AUTO_NORMALS		0x10 /* automatical calculate normal */
+#define D3D_DEPTH_PREPASS		0x20 /* shade opaque faces in D3D_Flush */
+#define D3D_TEST_ONLY			0x40 /* z-test faces without drawing them */
+#define D3D_SORT_OPAQUE			0x80 /* draw opaque faces front-to-back */
+#define D3D_SORT_BLENDED		0x100 /* draw blended faces back-to-front */
+#define D3D_DITHER				0x200 /* dither colors on 16-bit screen */
+#define D3D_SPAN_BUFFER			0x400 /* resolve opaque faces by spans in D3D_Flush */
+#define D3D_MEMOIZE				0x800 /* skip frames same as previous one */
+#define D3D_VIEW_THREADS		0x1000 /* draw views by threads of their own */
+#define D3D_BAKE_LIGHTS			0x2000 /* keep lighting of vertex arrays */
+
+// most vertices and triangles, D3D_DrawElements or D3D_Begin/D3D_End can take
+#define D3D_MAX_VERTICES		100000
+#define D3D_MAX_FACES			(D3D_MAX_VERTICES-2)
+
+// rendering statistics, accumulated since D3D_ResetStats
+typedef struct {
+	int triangles;	// triangles passed to rasterizer
+	int pixels;		// pixels rasterized (covered by spans, before z-test)
+} D3D_Stats;
 
 // support functions
 int D3D_Init();
@@ -49,12 +83,36 @@ void D3D_Disable(int flags); // disables them
 void D3D_ClearScreen(float r, float g, float b); // clear screen with specific color
 void D3D_ClearZBuffer();
 void D3D_ClearLights(); // remove all lights from scene
+void D3D_GetStats(D3D_Stats *s);
+void D3D_ResetStats();
+
+// occlusion query counts pixels, which pass z-test between D3D_BeginQuery
+// and D3D_EndQuery. Faces deferred until D3D_Flush are counted by it, so
+// result is complete only after flush, unless they were tested with
+// D3D_TEST_ONLY or had depth laid down by D3D_DEPTH_PREPASS
+//
+// D3D_SPAN_BUFFER keeps visible spans of opaque faces per scanline, so
+// that each pixel is shaded once. It ignores depth of faces drawn before,
+// so all opaque faces of frame should go through it. Depth buffer is
+// written only, if blended faces are deferred along with them, faces
+// belong to static layer, or faces without z-test were drawn among them
+void D3D_BeginQuery();
+void D3D_EndQuery();
+int D3D_GetQueryResult();
+
+// capture records public calls along with textures and vertex arrays
+// they use, so that scene can be replayed without its program. Replay
+// starts from state, renderer had at D3D_BeginCapture
+void D3D_BeginCapture(char *path);
+void D3D_CaptureFrame(); // marks end of frame in capture
+void D3D_EndCapture();
 
 
 // scene transformation functions
 void D3D_Push();
 void D3D_Pop();
 void D3D_LoadIdentity();
+void D3D_LoadMatrix(float *m); // replaces current matrix
 void D3D_Scale(float x, float y, float z);
 void D3D_Translate(float x, float y, float z);
 void D3D_Rotate(float x, float y, float z);
@@ -70,11 +128,75 @@ void D3D_MulMM(float *a, float *b, float *r);
 // 3-d drawing related functions
 void D3D_Begin(int type);
 void D3D_End();
+void D3D_Flush(); // finish deferred rendering
+// static layer is drawn once and kept as snapshot of colour and depth.
+// D3D_BeginStatic restores it and returns 0, or returns 1, when it has
+// to be cleared and drawn again up to D3D_EndStatic. That happens, when
+// matrix, lights, state or target change, textures get loaded, or after
+// D3D_InvalidateStatic, so lights and state should be set before it
+int D3D_BeginStatic();
+void D3D_EndStatic();
+void D3D_InvalidateStatic(); // static layer has changed
+// finish frame on screen, call it before presenting frame. Returns 0,
+// if D3D_MEMOIZE found frame same as previous one and left screen as it
+// was, so it needn't be presented again
+int D3D_Present();
+// with D3D_MEMOIZE faces and clears are hashed and kept until
+// D3D_Present, which draws them only if hash differs from last frame.
+// Textures are told apart by pixels, so changes made to them in place
+// and drawing onto screen by program need D3D_Redraw. Depth pre-pass
+// and span buffer aren't done, and queries aren't counted in skipped
+// frames. Frame is drawn as it goes, when renderer has to read or
+// change target before D3D_Present
+void D3D_Redraw(); // draw next frame, even if it is same
+// arrays of (x,y,z), (nx,ny,nz) and (u,v) for D3D_DrawElements. Normals
+// and uvs can be 0, then current ones are used. Arrays aren't copied
+void D3D_VertexArrays(int vertices, float *xyz, float *normals, float *uvs);
+// draw triangles, given by 'count' indices of 2 or 4 bytes size. With
+// D3D_BAKE_LIGHTS light of arrays is kept and recomputed only for lights,
+// which changed, or when matrix does. Arrays are told apart by address,
+// so ones, which change in place, shouldn't be drawn with it
+void D3D_DrawElements(int type, int count, int index_size, void *indices);
 void D3D_SetScreen(SDL_Surface *screen);
+// draw following faces into 'n' views instead of screen. Faces are lit
+// once, in space of current matrix, and moved by each view's matrix
+// (16 floats per view) into its target, which gets depth buffer of its
+// own. Views are drawn right away, without tiling, resolution scale or
+// deferral, clears go to all of them and capture doesn't keep them.
+// 0 views go back to screen
+void D3D_SetViews(int n, float *matrices, SDL_Surface **targets);
+// render into 8x8 pixel tiles, which D3D_Present copies to screen. Screen
+// isn't drawn before that, so should be cleared with D3D_ClearScreen
+void D3D_SetTiled(int tiled);
+// render at 'scale' of screen size, which D3D_Present upscales with
+// D3D_NEAREST or D3D_LINEAR filter (32-bit screen only)
+void D3D_SetResolution(float scale, int filter);
+// lower resolution down to 'min_scale', when frames take longer than
+// 'ms', and raise it back, when they are faster. 0 ms turns it off
+void D3D_SetFrameBudget(float ms, float min_scale);
 void D3D_SetTexture(SDL_Surface *texture);
+// returns placeholder texture, which can be used right away. Image is
+// decoded in background and replaces it at D3D_Flush. Don't free texture,
+// until D3D_PendingTextures() gets zero
+SDL_Surface *D3D_LoadTextureAsync(char *path);
+int D3D_PendingTextures(); // textures, which weren't loaded yet
+SDL_Surface *D3D_LoadTexture(char *path); // 0 if it can't be loaded
+// keep converted textures in 'dir' and map them on next loads, instead
+// of decoding. Mapped textures are read-only and live until D3D_Quit
+void D3D_SetTextureCache(char *dir);
+// convert surface to texture of given format. D3D_PAL8 keeps palette in
+// BGRA order (not as SDL_Color) and D3D_BC1 lays blocks into 4-bit surface
+SDL_Surface *D3D_PrepareTexture(SDL_Surface *s, int format);
 void D3D_SetMapper(int m);
+// 32-bit float depth by default, 24 bits are fixed point with 8 spare
+// bits, 16 bits halve its traffic. Depth buffer should be cleared after
+// change
+void D3D_SetDepthBits(int bits);
 void D3D_SetShading(int s);
 void D3D_SetAmbient(float r, float g, float b); // sets ambient glow
+void D3D_FrontFace(int w); // winding of visible faces, D3D_CW by default
+void D3D_SetNearClip(float z); // distance of projection plane, faces are clipped at it
+void D3D_SetPerspective(int p); // D3D_AFFINE by default
 
 
 // following functions used to set next vertex parameters
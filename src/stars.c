@@ -51,7 +51,8 @@ void draw_scene(SDL_Surface *surface) {
 		srand(time(0));
 		D3D_Init();
 		atexit(D3D_Quit);
-		texture = IMG_Load("pics/star.png");
+		D3D_SetTextureCache("pics/cache");
+		texture = D3D_LoadTextureAsync("pics/star.png");
 
 		// Create A Loop That Goes Through All The Stars
 		for(loop = 0; loop < NUM; loop++) {
@@ -73,7 +74,7 @@ void draw_scene(SDL_Surface *surface) {
 	D3D_SetMapper(D3D_NEAREST);
 	D3D_SetTexture(texture);
 
-	D3D_Enable(D3D_BLENDING);
+	D3D_Enable(D3D_BLENDING|D3D_SORT_BLENDED);
 	D3D_Disable(D3D_LIGHTS|D3D_CULLING|D3D_ZTEST);
 
 
@@ -87,6 +88,10 @@ void draw_scene(SDL_Surface *surface) {
 	D3D_SetAmbient(0.0,0.0,0.0);
 	D3D_Scale(50, 50, 50); // scale scene by screen size
 
+	// all stars go in one batch, which is sorted back-to-front,
+	// as vertices are transformed by D3D_Vertex right away
+	D3D_Begin(D3D_QUADS);
+
 	/* Loop Through All The Stars */
 	for(loop = 0; loop < NUM; loop++) {
 		D3D_Push(); // Save our position, so we can restore it After Drawing This Star
@@ -117,13 +122,11 @@ void draw_scene(SDL_Surface *surface) {
 			// Assign A Color
 			D3D_Color(stars[NUM-loop-1].r, stars[NUM-loop-1].g, stars[NUM-loop-1].b);
 
-			// Begin Drawing The Textured Quad
-			D3D_Begin(D3D_QUADS);
-				D3D_TexCoord(0.0f, 0.0f); D3D_Vertex(-1.0f, -1.0f, 0.0f );
-				D3D_TexCoord(1.0f, 0.0f); D3D_Vertex( 1.0f, -1.0f, 0.0f );
-				D3D_TexCoord(1.0f, 1.0f); D3D_Vertex( 1.0f,  1.0f, 0.0f );
-				D3D_TexCoord(0.0f, 1.0f); D3D_Vertex(-1.0f,  1.0f, 0.0f );
-			D3D_End();
+			// Draw The Textured Quad
+			D3D_TexCoord(0.0f, 0.0f); D3D_Vertex(-1.0f, -1.0f, 0.0f );
+			D3D_TexCoord(1.0f, 0.0f); D3D_Vertex( 1.0f, -1.0f, 0.0f );
+			D3D_TexCoord(1.0f, 1.0f); D3D_Vertex( 1.0f,  1.0f, 0.0f );
+			D3D_TexCoord(0.0f, 1.0f); D3D_Vertex(-1.0f,  1.0f, 0.0f );
 		}
 
 		D3D_Rotate(0, 0, spin); // Rotate The Star On The Z Axis
@@ -135,12 +138,10 @@ void draw_scene(SDL_Surface *surface) {
 
 		// Draw Star Using Its Color
 		D3D_Color4(stars[loop].r, stars[loop].g, stars[loop].b, brightness);
-		D3D_Begin(D3D_QUADS);
 		D3D_TexCoord(0, 0); D3D_Vertex(-1, -1, 0);
 		D3D_TexCoord(1, 0); D3D_Vertex( 1, -1, 0);
 		D3D_TexCoord(1, 1); D3D_Vertex( 1,  1, 0);
 		D3D_TexCoord(0, 1); D3D_Vertex(-1,  1, 0);
-		D3D_End();
 
 		spin += 0.01f; // Used To Spin The Stars
 		stars[loop].angle += (float)loop / NUM; // Changes The Angle Of A Star
@@ -157,5 +158,7 @@ void draw_scene(SDL_Surface *surface) {
 		}
 		D3D_Pop();
 	}
+	D3D_End();
+	D3D_Present();
 	++frame;
 }
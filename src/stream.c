@@ -0,0 +1,194 @@
+/*
+** Copyright (C) 2006 Exa
+** This code is free software; you can redistribute it and/or
+** modify it under the terms of GNU Lesser General Public License.
+*/
+
+
+// streaming of rendered frames to file or pipe by background thread
+
+#include <stdlib.h>
+#include <string.h>
+#include "stream.h"
+#include "trace.h"
+
+// keeps compiler from moving memory accesses across it. x86 doesn't
+// reorder stores with other stores, so nothing more is needed there
+#define BARRIER() asm volatile("" ::: "memory")
+
+static void put(Stream *s, void *p, int size) {
+	if(fwrite(p, 1, size, s->out) != size) {
+		fprintf(stderr, "stream write failed\n");
+		exit(-1);
+	}
+}
+
+// unpack pixel into r, g, b
+#define RGB(f, p) \
+	r = ((p) & (f)->Rmask) >> (f)->Rshift; \
+	g = ((p) & (f)->Gmask) >> (f)->Gshift; \
+	b = ((p) & (f)->Bmask) >> (f)->Bshift;
+
+static void write_frame(Stream *s, SDL_Surface *f) {
+	SDL_PixelFormat *fmt = f->format;
+	int x, y, r, g, b;
+	int n = s->w*s->h;
+
+	switch(s->format) {
+	case STREAM_RAW:
+		if(f->pitch == s->w*4) {
+			put(s, f->pixels, n*4);
+		} else {
+			for(y = 0; y < s->h; y++)
+				put(s, (Uint8*)f->pixels + y*f->pitch, s->w*4);
+		}
+		break;
+	case STREAM_PPM: {
+		Uint8 *d = s->buffer;
+		for(y = 0; y < s->h; y++) {
+			Uint32 *p = (Uint32*)((Uint8*)f->pixels + y*f->pitch);
+			for(x = 0; x < s->w; x++, d += 3) {
+				RGB(fmt, p[x]);
+				d[0] = r;
+				d[1] = g;
+				d[2] = b;
+			}
+		}
+		fprintf(s->out, "P6\n%d %d\n255\n", s->w, s->h);
+		put(s, s->buffer, n*3);
+		break;
+	}
+	case STREAM_Y4M: { // BT.601, studio range
+		Uint8 *py = s->buffer, *pu = py+n, *pv = pu+n;
+		for(y = 0; y < s->h; y++) {
+			Uint32 *p = (Uint32*)((Uint8*)f->pixels + y*f->pitch);
+			for(x = 0; x < s->w; x++) {
+				RGB(fmt, p[x]);
+				*py++ = (( 66*r + 129*g +  25*b + 128) >> 8) + 16;
+				*pu++ = ((-38*r -  74*g + 112*b + 128) >> 8) + 128;
+				*pv++ = ((112*r -  94*g -  18*b + 128) >> 8) + 128;
+			}
+		}
+		fputs("FRAME\n", s->out);
+		put(s, s->buffer, n*3);
+		break;
+	}
+	}
+}
+
+static int writer(void *data) {
+	Stream *s = data;
+
+	trace_thread("writer");
+	for(;;) {
+		SDL_SemWait(s->ready);
+		if(s->tail == s->head) break; // woken by stream_close
+
+		TRACE_BEGIN("write frame");
+		write_frame(s, s->frames[s->tail % STREAM_FRAMES]);
+		TRACE_END("write frame");
+		BARRIER(); // frame must be read before it is given back
+		s->tail++;
+		SDL_SemPost(s->done);
+		s->stats.written++;
+	}
+	fflush(s->out);
+	return 0;
+}
+
+Stream *stream_open(char *path, int format, SDL_Surface *like, int fps, int wait) {
+	SDL_PixelFormat *f = like->format;
+	int i;
+
+	Stream *s = (Stream*)malloc(sizeof(Stream));
+	memset(s, 0, sizeof(Stream));
+	s->format = format;
+	s->w = like->w;
+	s->h = like->h;
+	s->fps = fps;
+	s->wait = wait;
+
+	if(!strcmp(path, "-")) s->out = stdout;
+	else s->out = fopen(path, "wb");
+	if(!s->out) {
+		fprintf(stderr, "cant open '%s'\n", path);
+		exit(-1);
+	}
+
+	// frames are allocated once and reused, so renderer draws right
+	// into memory, which writer reads from. Writer wants 4 bytes per
+	// pixel, so 16-bit display still streams BGRA frames
+	Uint32 rm = f->Rmask, gm = f->Gmask, bm = f->Bmask, am = f->Amask;
+	if(f->BytesPerPixel != 4) {
+		rm = 0xff0000;
+		gm = 0xff00;
+		bm = 0xff;
+		am = 0xff000000;
+	}
+	for(i = 0; i < STREAM_FRAMES; i++) {
+		s->frames[i] = SDL_CreateRGBSurface(SDL_SWSURFACE, s->w, s->h, 32,
+			rm, gm, bm, am);
+	}
+	s->scratch = SDL_CreateRGBSurface(SDL_SWSURFACE, s->w, s->h, 32,
+		rm, gm, bm, am);
+	s->buffer = (Uint8*)malloc(s->w*s->h*3);
+
+	if(format == STREAM_Y4M) {
+		fprintf(s->out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",
+			s->w, s->h, fps);
+	}
+
+	s->ready = SDL_CreateSemaphore(0);
+	s->done = SDL_CreateSemaphore(0);
+	s->writer = SDL_CreateThread(writer, s);
+	return s;
+}
+
+SDL_Surface *stream_frame(Stream *s) {
+	// 'tail' is only read here, so writer can advance it at any time
+	while(s->head - s->tail == STREAM_FRAMES) {
+		if(!s->wait) {
+			s->dropping = 1;
+			return s->scratch;
+		}
+		SDL_SemWait(s->done);
+	}
+	s->dropping = 0;
+	return s->frames[s->head % STREAM_FRAMES];
+}
+
+void stream_submit(Stream *s) {
+	if(s->dropping) {
+		s->stats.dropped++;
+		return;
+	}
+
+	int depth = s->head - s->tail + 1;
+	if(depth > s->stats.max_depth) s->stats.max_depth = depth;
+	s->stats.depth_sum += depth;
+	s->stats.submitted++;
+
+	BARRIER(); // frame must be drawn before it is handed out
+	s->head++;
+	SDL_SemPost(s->ready);
+}
+
+void stream_close(Stream *s) {
+	int i;
+
+	SDL_SemPost(s->ready); // writer quits after queued frames
+	SDL_WaitThread(s->writer, 0);
+
+	StreamStats *t = &s->stats;
+	fprintf(stderr, "stream: %d frames written, %d dropped, "
+		"queue depth max %d mean %.1f\n", t->written, t->dropped,
+		t->max_depth, t->submitted ? (float)t->depth_sum/t->submitted : 0);
+
+	if(s->out != stdout) fclose(s->out);
+	for(i = 0; i < STREAM_FRAMES; i++) SDL_FreeSurface(s->frames[i]);
+	SDL_FreeSurface(s->scratch);
+	SDL_DestroySemaphore(s->ready);
+	SDL_DestroySemaphore(s->done);
+	free(s->buffer);
+	free(s);
+}
@@ -0,0 +1,52 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <SDL.h>
+#include <SDL_thread.h>
+
+// output formats
+#define STREAM_RAW		1 /* frames as rendered, 4 bytes per pixel */
+#define STREAM_PPM		2 /* concatenated binary PPM images */
+#define STREAM_Y4M		3 /* YUV4MPEG2 with 4:4:4 chroma */
+
+#define STREAM_FRAMES	8 /* frames in ring between renderer and writer */
+
+typedef struct {
+	int written;	// frames written out
+	int dropped;	// frames rendered, while ring was full
+	int max_depth;	// largest number of frames waiting to be written
+	int depth_sum;	// sum of waiting frames, sampled at every submit
+	int submitted;
+} StreamStats;
+
+// single producer, single consumer ring of frames. Counters only grow,
+// frames in [tail, head) belong to writer, frame at head to renderer
+typedef struct {
+	FILE *out;
+	int format;
+	int w, h, fps;
+	int wait;			// wait for free frame instead of dropping
+
+	SDL_Surface *frames[STREAM_FRAMES];
+	SDL_Surface *scratch; // target of dropped frames
+	volatile int head;	// next frame to be submitted, written by renderer
+	volatile int tail;	// next frame to be written out, written by writer
+	int dropping;		// renderer got scratch surface for this frame
+
+	SDL_sem *ready;		// counts submitted frames
+	SDL_sem *done;		// counts frames returned by writer
+	SDL_Thread *writer;
+	Uint8 *buffer;		// conversion buffer of writer
+
+	StreamStats stats;
+} Stream;
+
+// 'path' of "-" means stdout. Frames get pixel format of 'like', or
+// BGRA if 'like' isn't 32-bit
+Stream *stream_open(char *path, int format, SDL_Surface *like, int fps, int wait);
+SDL_Surface *stream_frame(Stream *s); // surface to render next frame into
+void stream_submit(Stream *s); // hands frame from stream_frame to writer
+void stream_close(Stream *s); // writes out queued frames and frees stream
+
+#endif
@@ -0,0 +1,161 @@
+/*
+** Copyright (C) 2006 Exa
+** This code is free software; you can redistribute it and/or
+** modify it under the terms of GNU Lesser General Public License.
+*/
+
+
+// recording of timed events into ring, written out in chrome trace format
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <SDL_thread.h>
+#include "trace.h"
+
+int trace_on;
+
+static char *trace_path;
+static Uint64 trace_start;
+
+static TraceEvent *events;
+static unsigned total_events; // ever recorded, ring index is it modulo size
+
+static struct {
+	Uint32 id;
+	char *name;
+} threads[TRACE_THREADS];
+static int total_threads;
+
+static float *frame_times; // milliseconds
+static int total_frames;
+static Uint64 frame_start;
+
+static Uint64 now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (Uint64)t.tv_sec*1000000000 + t.tv_nsec - trace_start;
+}
+
+void trace_open(char *path) {
+	trace_path = path;
+	trace_start = 0;
+	trace_start = now();
+	events = (TraceEvent*)malloc(TRACE_EVENTS*sizeof(TraceEvent));
+	frame_times = (float*)malloc(TRACE_FRAMES*sizeof(float));
+	total_events = 0;
+	total_frames = 0;
+	trace_thread("main");
+	trace_on = 1;
+}
+
+static void record(char *name, int phase, Uint64 time, Uint64 duration) {
+	// worker threads record too, so slot is taken atomically
+	unsigned i = __sync_fetch_and_add(&total_events, 1) % TRACE_EVENTS;
+	TraceEvent *e = events + i;
+	e->time = time;
+	e->duration = duration;
+	e->name = name;
+	e->thread = SDL_ThreadID();
+	e->phase = phase;
+}
+
+void trace_event(char *name, int phase) {
+	record(name, phase, now(), 0);
+}
+
+void trace_complete(char *name, Uint64 start, Uint64 duration) {
+	record(name, 'X', start, duration);
+}
+
+Uint64 trace_time() {
+	return now();
+}
+
+void trace_thread(char *name) {
+	// threads may start before tracing does, so names are always kept
+	int i = __sync_fetch_and_add(&total_threads, 1);
+	if(i >= TRACE_THREADS) return;
+	threads[i].id = SDL_ThreadID();
+	threads[i].name = name;
+}
+
+void trace_frame_begin() {
+	if(!trace_on) return;
+	frame_start = now();
+	trace_event("frame", 'B');
+}
+
+void trace_frame_end() {
+	if(!trace_on) return;
+	trace_event("frame", 'E');
+	frame_times[total_frames++ % TRACE_FRAMES] = (now() - frame_start)/1e6;
+}
+
+static int float_cmp(const void *a, const void *b) {
+	float x = *(float*)a, y = *(float*)b;
+	return x < y ? -1 : x > y;
+}
+
+// nearest rank percentile of sorted times
+static float percentile(float *t, int n, int p) {
+	int i = (n*p + 99)/100 - 1;
+	return t[i < 0 ? 0 : i];
+}
+
+static void summary() {
+	int i, n = total_frames < TRACE_FRAMES ? total_frames : TRACE_FRAMES;
+	float sum = 0;
+
+	if(!n) return;
+	qsort(frame_times, n, sizeof(float), float_cmp);
+	for(i = 0; i < n; i++) sum += frame_times[i];
+	fprintf(stderr, "trace: %d frames, mean %.2f ms, p50 %.2f ms, "
+		"p95 %.2f ms, p99 %.2f ms, max %.2f ms\n", n, sum/n,
+		percentile(frame_times, n, 50), percentile(frame_times, n, 95),
+		percentile(frame_times, n, 99), frame_times[n-1]);
+}
+
+void trace_close() {
+	unsigned i, first = 0;
+	char *sep = "";
+	int t;
+
+	if(!trace_on) return;
+	trace_on = 0;
+
+	FILE *out = fopen(trace_path, "w");
+	if(!out) {
+		fprintf(stderr, "cant open '%s'\n", trace_path);
+		exit(-1);
+	}
+
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for(t = 0; t < total_threads && t < TRACE_THREADS; t++) {
+		fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"tid\":%u,\"args\":{\"name\":\"%s\"}}", sep,
+			threads[t].id, threads[t].name);
+		sep = ",\n";
+	}
+	if(total_events > TRACE_EVENTS) {
+		fprintf(stderr, "trace: %u oldest events overwritten\n",
+			total_events - TRACE_EVENTS);
+		first = total_events - TRACE_EVENTS;
+	}
+	for(i = first; i < total_events; i++) {
+		TraceEvent *e = events + i % TRACE_EVENTS;
+		fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,"
+			"\"ts\":%.3f", sep, e->name, e->phase, e->thread, e->time/1e3);
+		if(e->phase == 'X') fprintf(out, ",\"dur\":%.3f", e->duration/1e3);
+		fprintf(out, "}");
+		sep = ",\n";
+	}
+	fprintf(out, "\n]}\n");
+	fclose(out);
+
+	summary();
+	free(frame_times);
+	// events are kept, as worker, which just passed test of trace_on,
+	// can still write into them
+}
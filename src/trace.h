@@ -0,0 +1,39 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <SDL.h>
+
+#define TRACE_EVENTS	(1<<18) /* events in ring, oldest ones get overwritten */
+#define TRACE_FRAMES	(1<<16) /* frame times kept for percentiles */
+#define TRACE_THREADS	16 /* named threads */
+
+typedef struct {
+	Uint64 time;		// nanoseconds since trace_open
+	Uint64 duration;	// nanoseconds, of 'X' events only
+	char *name;
+	Uint32 thread;
+	char phase;			// 'B', 'E' or 'X', as in chrome trace format
+} TraceEvent;
+
+extern int trace_on;
+
+// these cost one test while tracing is off. Names should be static
+// strings, as only pointers are recorded
+#define TRACE_BEGIN(name) do { if(trace_on) trace_event(name, 'B'); } while(0)
+#define TRACE_END(name) do { if(trace_on) trace_event(name, 'E'); } while(0)
+
+// start recording, events get written to 'path' by trace_close as
+// JSON, loadable by chrome://tracing and Perfetto
+void trace_open(char *path);
+// write out events and print frame time percentiles to stderr
+void trace_close(void);
+void trace_event(char *name, int phase);
+// event, which took 'duration' from 'start', both in nanoseconds as
+// given by trace_time. Time summed over many short calls goes so
+void trace_complete(char *name, Uint64 start, Uint64 duration);
+Uint64 trace_time(void); // nanoseconds since trace_open
+void trace_thread(char *name); // name calling thread in trace
+void trace_frame_begin(void);
+void trace_frame_end(void);
+
+#endif